@@ -10,6 +10,7 @@
 #include "net/linkaddr.h"
 #include "sys/node-id.h"
 #include "sys/log.h"
+#include "dev/serial-line.h"
 #include "lib/list.h"
 #include "lib/memb.h"
 #include "net/linkaddr.h"
@@ -21,6 +22,11 @@
 #include "common/temperature-sensor.h"
 #include "my_sensor.h"
 #include "my_functions.h"
+#include "link_estimator.h"
+#include "tx_queue.h"
+#include "rx_dispatch.h"
+#include "sensor_codec.h"
+#include "state_store.h"
 #include "packet_structure.h"
 #include "project-conf.h"
 
@@ -40,10 +46,12 @@ static  linkaddr_t node_index_to_addr[MAX_NODES] = {
   {{0xf4, 0xce, 0x36, 0x53, 0x21, 0x0a, 0x51, 0x32}}, // node 7
 };
 static int known_nodes[MAX_NODES] = {0};
+// discovery convergence
+static clock_time_t last_topology_change;
+static uint8_t hello_process_cnt = 0;
 
 // sensor data transmission
 
-static sensor_data recv_message;
 float battery_f[MAX_NODES] ={1,1,1,1,1,1,1,1};
 int battery_i[MAX_NODES] ={1,1,1,1,1,1,1,1};
 
@@ -53,6 +61,31 @@ MEMB(rt_mem,rt_entry,MAX_NODES);
 LIST(permanent_rt_table);
 MEMB(permanent_rt_mem,rt_entry,MAX_NODES);
 
+// cluster advertisement
+static uint8_t link_table[MAX_NODES*MAX_NODES];
+static uint8_t advertised_parent[MAX_NODES];
+static uint8_t advertised_backup[MAX_NODES];
+static uint16_t topology_version = 0;
+static uint8_t recluster_needed;
+static clock_time_t last_recluster;
+
+// set while a rediscovery is running, further NEWNODE packets are ignored
+static volatile int receive_newnode_before = 0;
+
+// localized repair
+static uint8_t repair_pending;
+static uint8_t repair_attempts;
+static uint8_t orphan[MAX_NODES];
+
+// multi-sink: our index in the shared address table, it is swapped with
+// index 0 at boot so the rest of this file can treat us as node 0
+static uint8_t my_global_index;
+// last sample per source, a repeat is a retransmission or a relay's copy
+static uint8_t last_sample_seq[MAX_NODES];
+static uint8_t sample_seen[MAX_NODES];
+// reference per direct member for its compact samples
+static sensor_dec member_dec[MAX_NODES];
+
 // heart beat
 static volatile uint8_t Node_death;
 static uint8_t heart_record[MAX_NODES];
@@ -138,9 +171,7 @@ void print_local_routing_table() {
 
 void forward_hello(struct dio_packet *pkt)
 {
-  nullnet_buf = (uint8_t *)pkt;
-  nullnet_len = sizeof(*pkt);
-  NETSTACK_NETWORK.output(NULL);
+  tx_queue_send(NULL, pkt, sizeof(*pkt), TXQ_CLASS_CONTROL, NULL, NULL);
 }
 
 void insert_entry_to_rt_table(const linkaddr_t *dst, const linkaddr_t *next_hop,uint8_t tot_hop, int16_t metric,uint16_t seq_no)
@@ -207,6 +238,77 @@ void print_rt_entries_pkt(const struct rt_entry_pkt *pkt)
   printf("+-----------------------------------------------------------------------------------+\n");
 }
 
+// Store a reported link, remember when the topology last really changed.
+// RSSI wobble within DISCOVERY_RSSI_TOL does not count as a change.
+void update_adjacency(int src_index, int dst_index, int16_t metric)
+{
+  if(src_index == dst_index)
+  {
+    adjacency_matrix[src_index][dst_index] = 255;
+    return;
+  }
+  if(abs(adjacency_matrix[src_index][dst_index] - metric) > DISCOVERY_RSSI_TOL
+     || (adjacency_matrix[src_index][dst_index] == 0 && metric != 0))
+  {
+    last_topology_change = clock_time();
+  }
+  adjacency_matrix[src_index][dst_index] = metric;
+  adjacency_matrix[dst_index][src_index] = metric;
+}
+
+int count_known_nodes()
+{
+  int cnt = 0;
+  for(int i = 0; i < MAX_NODES; i++) {
+    cnt += known_nodes[i];
+  }
+  return cnt;
+}
+
+// Finish as soon as the reports settle, keep going while they still
+// change the topology, but never beyond DISCOVERY_MAX_ROUNDS.
+int discovery_converged()
+{
+  int known = count_known_nodes();
+  clock_time_t quiet = clock_time() - last_topology_change;
+  if(hello_process_cnt < DISCOVERY_MIN_ROUNDS)
+  {
+    return 0;
+  }
+  if(hello_process_cnt >= DISCOVERY_MAX_ROUNDS)
+  {
+    LOG_WARN("Discovery stopped after %u rounds, %d/%d nodes known\n",
+             hello_process_cnt, known, DISCOVERY_EXPECTED_NODES);
+    return 1;
+  }
+  if(known >= DISCOVERY_EXPECTED_NODES)
+  {
+    return quiet >= DISCOVERY_SETTLE_FAST;
+  }
+  return quiet >= DISCOVERY_SETTLE_TIME;
+}
+
+// Drop everything learned so far and start a new discovery from seq 1.
+void reset_discovery()
+{
+  memb_init(&rt_mem);
+  list_init(local_rt_table);
+  insert_entry_to_rt_table(&linkaddr_node_addr, &linkaddr_node_addr, 0, 0, 0);
+  for (int i = 0; i < MAX_NODES; i++) {
+    for (int j = 0; j < MAX_NODES; j++) {
+      adjacency_matrix[i][j] = (i == j) ? 255 : 0;
+    }
+  }
+  memset(known_nodes, 0, sizeof(known_nodes));
+  // workers drop their assignment on a new discovery, advertise again after it
+  memset(advertised_parent, NO_PARENT, sizeof(advertised_parent));
+  memset(advertised_backup, NO_PARENT, sizeof(advertised_backup));
+  repair_pending = 0;
+  hello_process_cnt = 0;
+  last_topology_change = clock_time();
+  last_seq_id = 1;
+}
+
 bool parent_is_in_rt_table(const linkaddr_t *src)
 {
   rt_entry *iter = list_head(local_rt_table);
@@ -234,7 +336,8 @@ int get_hop(uint8_t* link_table, int id) {
               break;
           }
       }
-      if (next == -1) {
+      // no way up, or a loop between heads
+      if (next == -1 || hop >= MAX_NODES) {
           return -1;  
       }
       hop++;
@@ -246,6 +349,7 @@ int get_hop(uint8_t* link_table, int id) {
 int get_direct_link(uint8_t* link_table, int id) {
   int curr = id;
   int next = id;
+  int hop = 0;
   while (next != 0) {
       curr =next;
       next =-1;
@@ -255,7 +359,7 @@ int get_direct_link(uint8_t* link_table, int id) {
               break;
           }
       }
-      if (next == -1) {
+      if (next == -1 || hop++ >= MAX_NODES) {
           return -1;  
       }
      
@@ -263,285 +367,749 @@ int get_direct_link(uint8_t* link_table, int id) {
   return curr;
 }
 
-void advertise_node_addr(uint8_t* link_table,unsigned char* head_list)
+uint8_t get_parent(uint8_t* link_table, int id) {
+  for (int j = 0; j < MAX_NODES; j++) {
+    if (link_table[id*MAX_NODES+j] == 1) {
+      return j;
+    }
+  }
+  return NO_PARENT;
+}
+
+// 1 if node lies on the way from `from` up to the master, `from` included
+int path_contains(int from, int node)
+{
+  int curr = from;
+  for (int hop = 0; curr != 0 && curr != NO_PARENT && hop <= MAX_NODES; hop++) {
+    if (curr == node) {
+      return 1;
+    }
+    curr = get_parent(link_table, curr);
+  }
+  return 0;
+}
+
+int link_usable(int i, int j)
+{
+  short rssi = adjacency_matrix[i][j];
+  return rssi != 255 && rssi != 0 && rssi >= ADJACENCY_RSSI_TH;
+}
+
+// A way up for node i other than `primary`: a neighbour that is neither
+// below i nor behind primary, closest to the master first, then strongest
+// link. With primary NO_PARENT any attached neighbour qualifies.
+uint8_t choose_parent_except(int i, uint8_t primary)
+{
+  uint8_t best = NO_PARENT;
+  int best_hop = MAX_NODES;
+  short best_rssi = -128;
+  for (int j = 0; j < MAX_NODES; j++) {
+    if (j == i || j == primary || !link_usable(i, j)) {
+      continue;
+    }
+    int hop = (j == 0) ? 0 : get_hop(link_table, j);
+    if (hop < 0 || path_contains(j, i)
+        || (primary != 0 && primary != NO_PARENT && path_contains(j, primary))) {
+      continue;
+    }
+    if (hop < best_hop || (hop == best_hop && adjacency_matrix[i][j] > best_rssi)) {
+      best = j;
+      best_hop = hop;
+      best_rssi = adjacency_matrix[i][j];
+    }
+  }
+  return best;
+}
+
+uint8_t choose_backup_parent(int i, uint8_t primary)
+{
+  if (primary == NO_PARENT) {
+    return NO_PARENT;
+  }
+  return choose_parent_except(i, primary);
+}
+
+// Hop list from the master down the cluster tree to dest, first hop first.
+int build_source_route(int dest, source_route *route)
 {
-  static int find_flag = 0;
-  //matrix_printer(link_table, MAX_NODES);
-  int ch_direct_row_idx = 1;
-  for (;ch_direct_row_idx<MAX_NODES;ch_direct_row_idx++)
+  uint8_t up[SOURCE_ROUTE_MAX_HOPS];
+  int len = 0;
+  int curr = dest;
+  while (curr != 0) {
+    if (len >= SOURCE_ROUTE_MAX_HOPS) {
+      return 0;
+    }
+    up[len++] = curr;
+    curr = get_parent(link_table, curr);
+    if (curr == NO_PARENT) {
+      return 0;
+    }
+  }
+  route->len = len;
+  route->pos = 0;
+  for (int k = 0; k < len; k++) {
+    route->hop[k] = up[len - 1 - k];
+  }
+  return 1;
+}
+
+// Hops from node i to the master when it goes through its backup, 0 if
+// it has none.
+int get_backup_hop(int i)
+{
+  uint8_t b = advertised_backup[i];
+  if(b == NO_PARENT)
   {
-    if(link_table[ch_direct_row_idx*MAX_NODES] == 1)
-    {
-      LOG_INFO("FIND CONECTION\n\r");
-      struct advertise_packet pkt;
-      pkt.type = ADVERTISE_PACKET;
-      linkaddr_copy(&pkt.dest,&node_index_to_addr[ch_direct_row_idx]);
-      linkaddr_copy(&pkt.advertise_ch,&linkaddr_node_addr);
-      pkt.tot_hop = 1;
-      pkt.seq_id = 5;
-      //LOG_INFO("Sending ADVERTISE packet:\n");
-      //LOG_INFO("  Dest node:       %u\n", get_node_id_from_linkaddr(&linkaddr_node_addr));
-      //LOG_INFO("  Direct Link      %u\n", get_direct_link((uint8_t*)link_table,ch_direct_row_idx));
-      //LOG_INFO("  CH node:    %u\n", get_node_id_from_linkaddr(&linkaddr_node_addr));
-      //LOG_INFO("  Seq ID:          %u\n", pkt.seq_id);
-      nullnet_buf = (uint8_t *)&pkt;
-      nullnet_len = sizeof(pkt);
-      NETSTACK_NETWORK.output(& node_index_to_addr[ch_direct_row_idx]);
-
-    }
-  }
-
-  int j =0;
+    return 0;
+  }
+  int hop = get_hop(link_table, b);
+  return hop < 0 ? 0 : hop + 1;
+}
+
+void send_advertise(int i)
+{
+  struct advertise_packet pkt;
+  if(advertised_parent[i] == NO_PARENT || !build_source_route(i, &pkt.route))
+  {
+    return;
+  }
+  pkt.type = PKT_HDR(ADVERTISE_PACKET);
+  linkaddr_copy(&pkt.src_master,&linkaddr_node_addr);
+  linkaddr_copy(&pkt.dest,&node_index_to_addr[i]);
+  linkaddr_copy(&pkt.advertise_ch,&node_index_to_addr[advertised_parent[i]]);
+  if(advertised_backup[i] != NO_PARENT)
+  {
+    linkaddr_copy(&pkt.backup_ch,&node_index_to_addr[advertised_backup[i]]);
+  }
+  else
+  {
+    linkaddr_copy(&pkt.backup_ch,&linkaddr_null);
+  }
+  pkt.tot_hop = get_hop(link_table,i);
+  pkt.backup_hop = get_backup_hop(i);
+  pkt.version = topology_version;
+  tx_queue_send(&node_index_to_addr[pkt.route.hop[0]], &pkt, sizeof(pkt), TXQ_CLASS_CONTROL, NULL, NULL);
+}
+
+// Sampling settings of one node (255: all nodes). raw turns the raw
+// sample feed on or off, SENSOR_MODE_KEEP leaves it; the periods are in
+// seconds, 0 leaves them.
+void send_sensor_mode(int node, int raw, int period_min, int period_max)
+{
+  static sensor_mode_packet pkt;
+  static uint16_t mode_seq;
+  if(node != 255 && (node <= 0 || node >= MAX_NODES))
+  {
+    LOG_WARN("Sensor mode: no node %d\n", node);
+    return;
+  }
+  if(period_min < 0 || period_max > 255 || period_max < period_min)
+  {
+    LOG_WARN("Sensor mode: bad sample period %d..%d\n", period_min, period_max);
+    return;
+  }
+  pkt.type = PKT_HDR(SENSOR_MODE_PACKET);
+  linkaddr_copy(&pkt.src_master, &linkaddr_node_addr);
+  pkt.seq = ++mode_seq;
+  pkt.raw = raw == SENSOR_MODE_KEEP ? SENSOR_MODE_KEEP : raw != 0;
+  pkt.period_min = period_min;
+  pkt.period_max = period_max;
+  memset(pkt.scope, node == 255 ? 0xFF : 0, SCOPE_BYTES);
+  if(node != 255)
+  {
+    pkt.scope[node / 8] |= 1 << (node % 8);
+  }
+  LOG_INFO("Sensor mode of node %d: raw %d period %d..%d s\n", node, pkt.raw, period_min, period_max);
+  tx_queue_send(NULL, &pkt, sizeof(pkt), TXQ_CLASS_CONTROL, NULL, NULL);
+}
+
+// Flood the whole parent array, split into fragments of
+// CLUSTER_MAP_FRAG_ENTRIES nodes. Every node picks out its own entry.
+void broadcast_cluster_map()
+{
+  static cluster_map_packet pkt;
+  uint8_t frag_cnt = (MAX_NODES + CLUSTER_MAP_FRAG_ENTRIES - 1) / CLUSTER_MAP_FRAG_ENTRIES;
+  for (uint8_t frag = 0; frag < frag_cnt; frag++) {
+    pkt.type = PKT_HDR(CLUSTER_MAP_PACKET);
+    linkaddr_copy(&pkt.src_master, &linkaddr_node_addr);
+    pkt.version = topology_version;
+    pkt.frag = frag;
+    pkt.frag_cnt = frag_cnt;
+    pkt.first = frag * CLUSTER_MAP_FRAG_ENTRIES;
+    pkt.cnt = MIN(CLUSTER_MAP_FRAG_ENTRIES, MAX_NODES - pkt.first);
+    for (int k = 0; k < pkt.cnt; k++) {
+      int hop = get_hop(link_table, pkt.first + k);
+      pkt.entry[k].parent = advertised_parent[pkt.first + k];
+      pkt.entry[k].backup = advertised_backup[pkt.first + k];
+      pkt.entry[k].tot_hop = hop < 0 ? 0 : hop;
+      pkt.entry[k].backup_hop = get_backup_hop(pkt.first + k);
+    }
+    tx_queue_send(NULL, &pkt, CLUSTER_MAP_HDR_LEN + pkt.cnt * sizeof(cluster_map_entry), TXQ_CLASS_CONTROL, NULL, NULL);
+  }
+}
+
+// Everything needed to serve the network again after a reboot without a
+// new discovery. The version must survive, workers drop older ones.
+typedef struct
+{
+  uint16_t magic;
+  uint16_t topology_version;
+  uint16_t last_seq_id;
+  uint8_t known[MAX_NODES];
+  uint8_t link[MAX_NODES*MAX_NODES];
+  uint8_t parent[MAX_NODES];
+  uint8_t backup[MAX_NODES];
+  short adjacency[MAX_NODES][MAX_NODES];
+}saved_state;
+
+void save_state()
+{
+#if PERSIST_STATE
+  static saved_state st;
+  st.magic = STATE_MAGIC;
+  st.topology_version = topology_version;
+  st.last_seq_id = last_seq_id;
+  for(int i=0;i<MAX_NODES;i++)
+  {
+    st.known[i] = known_nodes[i];
+  }
+  memcpy(st.link, link_table, sizeof(st.link));
+  memcpy(st.parent, advertised_parent, sizeof(st.parent));
+  memcpy(st.backup, advertised_backup, sizeof(st.backup));
+  memcpy(st.adjacency, adjacency_matrix, sizeof(st.adjacency));
+  if(state_store_write(&st, sizeof(st)) < 0)
+  {
+    LOG_WARN("Can't save state\n\r");
+  }
+#endif
+}
+
+// Returns 1 when a valid saved state was loaded.
+int restore_state()
+{
+#if PERSIST_STATE
+  static saved_state st;
+  if(!state_store_read(&st, sizeof(st)))
+  {
+    return 0;
+  }
+  if(st.magic != STATE_MAGIC)
+  {
+    LOG_WARN("Ignoring invalid saved state\n\r");
+    return 0;
+  }
+  topology_version = st.topology_version;
+  last_seq_id = st.last_seq_id;
+  for(int i=0;i<MAX_NODES;i++)
+  {
+    known_nodes[i] = st.known[i];
+  }
+  memcpy(link_table, st.link, sizeof(link_table));
+  memcpy(advertised_parent, st.parent, sizeof(advertised_parent));
+  memcpy(advertised_backup, st.backup, sizeof(advertised_backup));
+  memcpy(adjacency_matrix, st.adjacency, sizeof(adjacency_matrix));
+  return 1;
+#else
+  return 0;
+#endif
+}
+
+// Advertise the cluster parents, but only when the parent map differs from
+// the one advertised last. Each change gets a new topology version.
+void advertise_node_addr()
+{
+  uint8_t parent[MAX_NODES];
+  uint8_t backup[MAX_NODES];
+  parent[0] = NO_PARENT;
+  backup[0] = NO_PARENT;
+  for (int i=1;i<MAX_NODES;i++) {
+    parent[i] = get_parent(link_table, i);
+    backup[i] = choose_backup_parent(i, parent[i]);
+  }
+  if(memcmp(parent, advertised_parent, sizeof(parent)) == 0
+     && memcmp(backup, advertised_backup, sizeof(backup)) == 0)
+  {
+    return;
+  }
+  memcpy(advertised_parent, parent, sizeof(parent));
+  memcpy(advertised_backup, backup, sizeof(backup));
+  topology_version++;
+  LOG_INFO("Parent map changed, advertising topology version %u\n\r", topology_version);
+  save_state();
+#if ADVERTISE_MODE == ADVERTISE_MODE_MAP
+  broadcast_cluster_map();
+#else
   for (int i=1;i<MAX_NODES;i++) {
-    if(head_list[j]+1 == i)
+    send_advertise(i);
+  }
+#endif
+}
+
+void rebuild_permanent_rt_table()
+{
+  short* rssi = (short*)adjacency_matrix;
+  memb_init(&permanent_rt_mem);
+  list_init(permanent_rt_table);
+  LOG_INFO("+------------------+ Permanent Routing Table: +--------------------+\n");
+  for(int i=1;i<MAX_NODES;i++)
+  {
+    int direct = get_direct_link((uint8_t*)link_table,i);
+    if(direct < 0)
     {
-      j++;
+      continue;
     }
-    else
-    {
-      find_flag = 0;
-      static linkaddr_t advertise_ch_addr;
-      for (int j = 0; j <MAX_NODES; j++) {
-        if (link_table[i*MAX_NODES + j] == 1) {     
-          linkaddr_copy(&advertise_ch_addr, &node_index_to_addr[j]);
-          find_flag = 1;
-          break;
-        }
+    rt_entry *e = memb_alloc(&permanent_rt_mem);
+    if(e != NULL) {
+      linkaddr_copy(&e->dest, &node_index_to_addr[i]);
+      linkaddr_copy(&e->next_hop, &node_index_to_addr[direct]);
+      e->tot_hop = get_hop((uint8_t*)link_table,i);
+      e->metric = rssi[direct];
+      e->seq_no = 1;
+      list_add(permanent_rt_table, e);
+      LOG_INFO("|No.%d | dest:%d | next:%d | tot_hop:%u | rssi:%d | seq:%u |\n",
+            i, i, direct,
+            e->tot_hop, e->metric, e->seq_no);
       }
-      if(!find_flag){
+  }
+  LOG_INFO("+------------------+ ------------------------ +--------------------+\n");
+}
 
+// Hang the roots of orphaned subtrees onto the best attached neighbour.
+// Nodes below a root come back with it. Returns the nodes still cut off.
+int reattach_orphans()
+{
+  int progress = 1;
+  int remaining = 0;
+  while (progress) {
+    progress = 0;
+    remaining = 0;
+    for (int i = 1; i < MAX_NODES; i++) {
+      if (!orphan[i]) {
+        continue;
+      }
+      if (get_hop(link_table, i) >= 0) {
+        orphan[i] = 0;
+        continue;
       }
-      else{
-        LOG_INFO("FIND CONECTION\n\r");
-        struct advertise_packet pkt;
-        pkt.type = ADVERTISE_PACKET;
-        static linkaddr_t direct_link_addr;
-        linkaddr_copy(&pkt.dest,&node_index_to_addr[i]);
-        linkaddr_copy(&pkt.advertise_ch,&advertise_ch_addr);
-        pkt.tot_hop = get_hop((uint8_t*)link_table,i);
-        pkt.seq_id = 5;
-        LOG_INFO("Sending ADVERTISE packet:\n");
-        //LOG_INFO("  Dest node:       %u\n", get_node_id_from_linkaddr(&node_index_to_addr[i]));
-        //LOG_INFO("  Direct Link      %u\n", get_direct_link((uint8_t*)link_table,i));
-        //LOG_INFO("  CH node:    %u\n", get_node_id_from_linkaddr(&advertise_ch_addr));
-        //LOG_INFO("  Seq ID:          %u\n", pkt.seq_id);
-        nullnet_buf = (uint8_t *)&pkt;
-        nullnet_len = sizeof(pkt);
-        linkaddr_copy(&direct_link_addr, &node_index_to_addr[get_direct_link((uint8_t*)link_table,i)]);
-        NETSTACK_NETWORK.output(& direct_link_addr);
-        find_flag = 0;
+      // wait until the orphan above us is attached
+      if (get_parent(link_table, i) != NO_PARENT) {
+        remaining++;
+        continue;
       }
+      uint8_t p = choose_parent_except(i, NO_PARENT);
+      if (p == NO_PARENT) {
+        remaining++;
+        continue;
+      }
+      link_table[i*MAX_NODES + p] = 1;
+      orphan[i] = 0;
+      progress = 1;
+      // GUI numbering: workers from 0, master is 255
+      printf("Newlink %d -> %d\r\n", i-1, p == 0 ? 255 : p-1);
+    }
+  }
+  return remaining;
+}
+
+// HELLO to the whole network, or only to the nodes set in scope.
+void broadcast_hello(const uint8_t *scope)
+{
+  static struct dio_packet my_hello_pkt;
+  my_hello_pkt.type = PKT_HDR(HELLO_PACKET);
+  linkaddr_copy(&my_hello_pkt.src, &linkaddr_node_addr);
+  linkaddr_copy(&my_hello_pkt.src_master, &linkaddr_node_addr);
+  my_hello_pkt.hop_count = 0;
+  my_hello_pkt.seq_id = last_seq_id++;
+  if(scope != NULL)
+  {
+    memcpy(my_hello_pkt.scope, scope, SCOPE_BYTES);
+  }
+  else
+  {
+    memset(my_hello_pkt.scope, 0xFF, SCOPE_BYTES);
+  }
+  forward_hello(&my_hello_pkt);
+}
+
+// A node we have not placed yet reported its links: attach it like an
+// orphan, everyone else keeps their assignment.
+void start_join(int index)
+{
+  if(orphan[index])
+  {
+    return;
+  }
+  LOG_INFO("Node %d joins the network\n\r", index);
+  orphan[index] = 1;
+  if(!repair_pending)
+  {
+    repair_pending = 1;
+    repair_attempts = 0;
+  }
+}
+
+// Let only the orphans answer, everyone else just forwards, so their
+// links to the attached part of the network show up in adjacency_matrix.
+void scoped_rediscovery()
+{
+  uint8_t scope[SCOPE_BYTES];
+  memset(scope, 0, sizeof(scope));
+  for (int i = 1; i < MAX_NODES; i++) {
+    if (orphan[i]) {
+      scope[i / 8] |= 1 << (i % 8);
     }
   }
+  LOG_INFO("Scoped rediscovery for orphaned nodes, attempt %u\n\r", repair_attempts);
+  broadcast_hello(scope);
 }
 
+// A node went silent: cut it out and re-attach only its subtree, the
+// rest of the network keeps its assignment and keeps delivering.
+void start_local_repair(int lost)
+{
+  printf("LinkLost: %d\r\n", lost-1);
+  for (int i = 0; i < MAX_NODES; i++) {
+    orphan[i] = (i != lost && path_contains(i, lost));
+  }
+  for (int j = 0; j < MAX_NODES; j++) {
+    link_table[lost*MAX_NODES + j] = 0;
+    link_table[j*MAX_NODES + lost] = 0;
+    adjacency_matrix[lost][j] = (j == lost) ? 255 : 0;
+    adjacency_matrix[j][lost] = (j == lost) ? 255 : 0;
+  }
+  known_nodes[lost] = 0;
+  repair_attempts = 0;
+  repair_pending = 1;
+  if(reattach_orphans() == 0)
+  {
+    repair_pending = 0;
+    rebuild_permanent_rt_table();
+    return;
+  }
+  scoped_rediscovery();
+}
 
-// Receive hello packet callback
-// 1.forward hello packet
-// 2.reply to the src node
-// 3,adding the hello packet info from the rt_table
-static void DIO_PACKET_callback(const void *data, uint16_t len,
-                           const linkaddr_t *src, const linkaddr_t *dest)
+// Runs every delivery tick while orphans are left: retry with the links
+// reported since, give up to a full rediscovery after REPAIR_MAX_ATTEMPTS.
+void continue_local_repair()
 {
-  int8_t rssi = (int8_t)packetbuf_attr(PACKETBUF_ATTR_RSSI);
-  //LOG_INFO("Hello Packet Process begin\r\n");
-  if(rssi <= RSSSI_TH)
+  repair_attempts++;
+  if(reattach_orphans() == 0)
   {
-    LOG_WARN("low RSSI DAO, rejected\n\r");
+    LOG_INFO("Local repair complete\n\r");
+    repair_pending = 0;
+    rebuild_permanent_rt_table();
     return;
   }
-  // processing the hello packet info
-  if(node_id == MASTER_NODE_ID) 
+  if(repair_attempts >= REPAIR_MAX_ATTEMPTS)
   {
-    leds_single_off(LEDS_LED2);
+    LOG_WARN("Local repair failed, rediscovering the network\n\r");
+    repair_pending = 0;
+    receive_newnode_before = 1;
+    net_is_stable = 0;
+    reset_discovery();
     return;
   }
+  scoped_rediscovery();
+}
 
+// Anything that reaches us from a node proves it is alive, heartbeats
+// are only sent by nodes that had nothing else to say.
+void note_alive(int index)
+{
+  if(index > 0 && index < MAX_NODES)
+  {
+    heart_record[index] = 0;
+  }
+}
+
+// Smoothed RSSI of the link the current frame came in on.
+int8_t smoothed_rssi(const linkaddr_t *src)
+{
+  link_stats *link = link_est_lookup(src);
+  if(link == NULL)
+  {
+    return (int8_t)packetbuf_attr(PACKETBUF_ATTR_RSSI);
+  }
+  return link_est_rssi(link);
 }
 
 static void DAO_PACKET_callback(const void *data, uint16_t len,
                            const linkaddr_t *src, const linkaddr_t *dest)
 {
-  leds_single_on(LEDS_LED2);
   LOG_INFO("Receiving RT_REPORT_PACEKT:\n");
   struct rt_entry_pkt *pkt = (struct rt_entry_pkt *)data;
-  pkt->hop_count++;
-  int8_t rssi = (int8_t)packetbuf_attr(PACKETBUF_ATTR_RSSI);
-  // avoid unstalbe link hard decision
-  if(rssi <= RSSSI_TH)
+  // a worker of another sink next to us
+  if(!linkaddr_cmp(&pkt->sink, &linkaddr_node_addr))
   {
-    LOG_WARN("low RSSI DAO, rejected\n\r");
     return;
   }
+  pkt->hop_count++;
+  int8_t rssi = smoothed_rssi(src);
   patch_update_local_rt_table(src,src,pkt->hop_count,rssi,pkt->seq_id);
     LOG_INFO("Master Node get RT_REPORT_PACKET:\n");
     int src_index = get_node_id_from_linkaddr(&pkt->src);
-    known_nodes[src_index] = 1;
-    // update the adjacency matrix
     int dst_index = get_node_id_from_linkaddr(&pkt->rt_dest);
-    if (src_index == dst_index) 
+    if(src_index >= MAX_NODES || dst_index >= MAX_NODES)
     {
-      adjacency_matrix[src_index][dst_index] = 255;
+      LOG_WARN("RT_REPORT from unknown node, ignored\n\r");
+      return;
     }
-    else
+    if(!known_nodes[src_index])
     {
-      adjacency_matrix[src_index][dst_index] = pkt->rt_metric;
-      adjacency_matrix[dst_index][src_index] = pkt->rt_metric;
+      known_nodes[src_index] = 1;
+      last_topology_change = clock_time();
     }
+    note_alive(src_index);
+    // not yet clustered at all, the first clustering places everyone
+    if(net_is_stable && !recluster_needed && src_index > 0
+       && get_hop(link_table, src_index) < 0)
+    {
+      start_join(src_index);
+    }
+    // update the adjacency matrix
+    update_adjacency(src_index, dst_index, pkt->rt_metric);
     print_adjacency_matrix();
     // go through the routing report rt_table, update the local rt table
     // note that next hop would be the packet src 
     patch_update_local_rt_table(&pkt->rt_dest,src,pkt->rt_tot_hop+1,pkt->rt_metric,pkt->rt_seq_no);
     // printf("\n\n%d\n\n", pkt->battery);
     battery_i[src_index] = pkt->battery;
-    
-    leds_single_off(LEDS_LED2);
+}
+
+// One node's sample, sent on its own or inside an aggregate.
+// Index in the shared address table. Lines for the host use it, so the
+// host can merge what several sinks report about one node.
+static int host_index(int i)
+{
+  return i == 0 ? my_global_index : (i == my_global_index ? 0 : i);
+}
+
+static void report_sample(uint16_t src_id, const sensor_sample *sample)
+{
+  if(sample->flags & SENSOR_FLAG_ALIVE)
+  {
+    note_alive(src_id);
+  }
+  if(sample_seen[src_id] && last_sample_seq[src_id] == sample->seq)
+  {
+    LOG_INFO("Duplicate sample %u from %u dropped\n\r", sample->seq, src_id);
+    return;
+  }
+  // a stored sample behind a newer one is history, it must not move the
+  // GUI back to an old state
+  if((sample->flags & SENSOR_FLAG_STORED) && sample_seen[src_id] &&
+     (int8_t)(sample->seq - last_sample_seq[src_id]) < 0)
+  {
+    LOG_INFO("Stored sample %u from %u, %u s old: %s%s\n\r", sample->seq, src_id, sample->age,
+      (sample->flags & SENSOR_FLAG_OCCUPIED) ? "occupied" : "free",
+      (sample->flags & SENSOR_FLAG_OCC_EVENT) ? ", changed" : "");
+    return;
+  }
+  sample_seen[src_id] = 1;
+  last_sample_seq[src_id] = sample->seq;
+  battery_i[src_id] = sample->battery;
+
+  printf("Received data are from %d:\n\r", src_id);
+	printf("batttery: [%d](mV):\n\r", sample->battery);
+	printf("temperature: [%d](C):\n\r", sample->temperature);
+  // Seq lets the host drop the same sample reported by two sinks
+  int node = host_index(src_id);
+  printf("Node: %d SensorType: 1 Value: %d Battery: %d Seq: %u \n\r",
+    node, sample->light_lux, sample->battery*100/3700, sample->seq);
+  printf("Node: %d SensorType: 2 Value: %d Battery: %d Seq: %u \n\r",
+    node, sample->distance, sample->battery*100/3700, sample->seq);
+  // the node's own decision, Event: 1 when it just changed
+  if(sample->flags & SENSOR_FLAG_OCC_KNOWN)
+  {
+    printf("Node: %d Occupied: %d Event: %d Age: %u Seq: %u \n\r", node,
+      (sample->flags & SENSOR_FLAG_OCCUPIED) != 0, (sample->flags & SENSOR_FLAG_OCC_EVENT) != 0,
+      sample->age, sample->seq);
+  }
 }
 
 static void SENSOR_PACKET_callback(const void *data, uint16_t len, 
                             const linkaddr_t *src, const linkaddr_t *dest){
-  int8_t rssi = (int8_t)packetbuf_attr(PACKETBUF_ATTR_RSSI);
-  //LOG_INFO("Hello Packet Process begin\r\n");
-  if(rssi <= RSSSI_TH)
+  const sensor_data *msg = (const sensor_data *)data;
+  uint16_t src_id = get_node_id_from_linkaddr(&msg->source);
+  if(src_id >= MAX_NODES)
+  {
+    LOG_WARN("Can't find the src id\n\r");
+    return;
+  }
+  sensor_sample sample;
+  sensor_sample_from(&sample, src_id, msg);
+  report_sample(src_id, &sample);
+}
+
+// A direct member's own sample, encoded against the last one we decoded.
+static void SENSOR_COMPACT_PACKET_callback(const void *data, uint16_t len,
+                            const linkaddr_t *src, const linkaddr_t *dest)
+{
+  if(!linkaddr_cmp(dest, &linkaddr_node_addr))
   {
-    LOG_WARN("low RSSI DAO, rejected\n\r");
     return;
-  }                    
-	memcpy(&recv_message, (sensor_data*)data, sizeof(recv_message));
-  uint16_t src_id = get_node_id_from_linkaddr(&recv_message.source);
-  if(src_id == -1)
+  }
+  uint16_t src_id = get_node_id_from_linkaddr(src);
+  if(src_id >= MAX_NODES)
   {
     LOG_WARN("Can't find the src id\n\r");
     return;
   }
-  battery_i[src_id] = recv_message.battery;
-
-  printf("Received data are from %d:\n\r", get_node_id_from_linkaddr(&recv_message.source));
-	printf("batttery: [%d](mV):\n\r", recv_message.battery);
-	printf("temperature: [%d](C):\n\r", recv_message.temperature);
-  printf("Node: %d SensorType: 1 Value: %d Battery: %d \n\r",
-    src_id, recv_message.light_lux, recv_message.battery*100/3700);
-  printf("Node: %d SensorType: 2 Value: %d Battery: %d \n\r",
-    src_id, recv_message.distance, recv_message.battery*100/3700);
-
+  sensor_sample sample;
+  if(sensor_decode(&member_dec[src_id], data, len, &sample) < 0)
+  {
+    LOG_WARN("Compact sample from %u not decodable\n", src_id);
+    return;
+  }
+  sample.node = src_id;
+  report_sample(src_id, &sample);
 }
- 
 
-static void ADVERTISE_PACKET_callback(const void *data, uint16_t len, 
-                            const linkaddr_t *src, const linkaddr_t *dest) {
-  if(len != sizeof(struct advertise_packet)) {
+// Samples a cluster head collected, already in our numbering.
+static void SENSOR_AGG_PACKET_callback(const void *data, uint16_t len,
+                            const linkaddr_t *src, const linkaddr_t *dest)
+{
+  const sensor_agg_packet *pkt = (const sensor_agg_packet *)data;
+  if(pkt->cnt > SENSOR_AGG_MAX || len != SENSOR_AGG_HDR_LEN + pkt->cnt * sizeof(sensor_sample))
+  {
     LOG_WARN("Wrong packet size: %u\n", len);
     return;
   }
-  //struct advertise_packet *pkt = (struct advertise_packet *)data;
-  int8_t rssi = (int8_t)packetbuf_attr(PACKETBUF_ATTR_RSSI);
-  //LOG_INFO("Geting ADVERTISE packet:\n");
-  //LOG_INFO("  Dest node:       %u\n", get_node_id_from_linkaddr(&pkt->dest));
-  //LOG_INFO("  CH node:    %u\n", get_node_id_from_linkaddr(&pkt->advertise_ch));
-  //LOG_INFO("  Seq ID:          %u\n", pkt->seq_id);
-  //LOG_INFO("Hello Packet Process begin\r\n");
-  if(rssi <= -75)
+  for(int i = 0; i < pkt->cnt; i++)
   {
-    LOG_WARN("low RSSI DAO, rejected\n\r");
-    return;
+    if(pkt->sample[i].node < MAX_NODES)
+    {
+      report_sample(pkt->sample[i].node, &pkt->sample[i]);
+    }
   }
-  
 }
+ 
 
 static void HEARTBEAT_PACKET_callback(const void *data, uint16_t len, 
                             const linkaddr_t *src, const linkaddr_t *dest){
   heartbeat_packet* pkt = (heartbeat_packet*)data;
-  linkaddr_t addr = pkt->src;
-  int index = get_node_id_from_linkaddr(&addr);
-  if(heart_record[index]>0){
-    heart_record[index] --;;
+  link_est_rx_seq(src, pkt->seq);
+  // one summary covers the sender and everything it heard below it
+  for(int i = 1; i < MAX_NODES; i++){
+    if((pkt->alive[i / 8] >> (i % 8)) & 1){
+      note_alive(i);
+    }
   }
   LOG_INFO("Receiving Heart Beat Packet\n\r");
-  LOG_INFO("  Src node:       %u\n", get_node_id_from_linkaddr(&pkt->des));
-  LOG_INFO("  Dest node:     %u\n", get_node_id_from_linkaddr(&pkt->src));
+  LOG_INFO("  Src node:       %u\n", get_node_id_from_linkaddr(&pkt->src));
+  LOG_INFO("  Alive map:     0x%02x\n", pkt->alive[0]);
+  // a direct member that missed its advertisement, it would not notice
+  int index = get_node_id_from_linkaddr(&pkt->src);
+  if(net_is_stable && topology_version != 0 && index > 0 && index < MAX_NODES
+     && (int16_t)(pkt->version - topology_version) < 0)
+  {
+    LOG_INFO("Node %d holds version %u, refreshing to %u\n\r", index, pkt->version, topology_version);
+    send_advertise(index);
+  }
 
 }
 
 
-static volatile int receive_newnode_before = 0;
-
-void NEWNODE_PACKET_callback(const void *data, uint16_t len,
+// A worker noticed a newer topology version than its own: re-send its entry.
+static void REFRESH_PACKET_callback(const void *data, uint16_t len,
                             const linkaddr_t *src, const linkaddr_t *dest)
 {
-  // Only process packets with the correct type
-    if(receive_newnode_before)
+  const refresh_packet *pkt = (const refresh_packet *)data;
+  int index = get_node_id_from_linkaddr(&pkt->src);
+  if(index <= 0 || index >= MAX_NODES || !net_is_stable)
+  {
+    return;
+  }
+  note_alive(index);
+  if(!linkaddr_cmp(&pkt->parent, &linkaddr_null))
+  {
+    int p = get_node_id_from_linkaddr(&pkt->parent);
+    uint16_t version = topology_version;
+    // the backup was chosen outside the node's subtree, but the map may
+    // have changed since
+    if(p < 0 || p >= MAX_NODES || p == index || path_contains(p, index))
     {
-      LOG_INFO("I have received the NewNode Pacekt\r\n");
+      LOG_WARN("Node %d failed over to unusable parent %d\n\r", index, p);
+      send_advertise(index);
       return;
     }
-    else{
-      LOG_INFO("Discover NewNode, begin to reorganise\r\n");
-      receive_newnode_before = 1;
-      net_is_stable = 0;
-      memb_init(&rt_mem);
-      list_init(local_rt_table);
-      insert_entry_to_rt_table(&linkaddr_node_addr, &linkaddr_node_addr, 0, 0, 0);
-      for (int i = 0; i < MAX_NODES; i++) {
-        for (int j = 0; j < MAX_NODES; j++) {
-          adjacency_matrix[i][j] = (i == j) ? 255 : 0;
-        }
-      }
-      last_seq_id = 1;
+    LOG_INFO("Node %d failed over to parent %d\n\r", index, p);
+    for (int j = 0; j < MAX_NODES; j++) {
+      link_table[index*MAX_NODES + j] = 0;
     }
- 
+    link_table[index*MAX_NODES + p] = 1;
+    // GUI numbering: workers from 0, master is 255
+    printf("Newlink %d -> %d\r\n", index-1, p == 0 ? 255 : p-1);
+    rebuild_permanent_rt_table();
+    advertise_node_addr();
+    // parent map unchanged, the node still needs its new backup
+    if(version == topology_version)
+    {
+      send_advertise(index);
+    }
+    return;
+  }
+  LOG_INFO("Node %d holds version %u, refreshing to %u\n\r",
+           index, pkt->version, topology_version);
+  send_advertise(index);
 }
 
 
-static void HELLO_Callback(const void *data, uint16_t len,
-                           const linkaddr_t *src, const linkaddr_t *dest)
+// A node that missed discovery asks for neighbours. Answer like any
+// attached worker does; its link reports then start an incremental join.
+void NEWNODE_PACKET_callback(const void *data, uint16_t len,
+                            const linkaddr_t *src, const linkaddr_t *dest)
 {
-  leds_single_on(LEDS_LED2);
-  uint8_t type = *((uint8_t *)data);
-  //LOG_INFO("<< Received packet, type = %d, len = %d\n", type, len);
-  switch(type) {
-    case HELLO_PACKET:
-      DIO_PACKET_callback(data, len, src, dest);
-      leds_single_off(LEDS_LED2);
-      break;
-    case RT_REPORT_PACKET:
-      DAO_PACKET_callback(data, len, src, dest);
-      leds_single_off(LEDS_LED2);
-      break;
-    case SENSOR_DATA_PACKET:
-      SENSOR_PACKET_callback(data, len, src, dest);
-      leds_single_off(LEDS_LED2);
-      break;
-    case ADVERTISE_PACKET:
-      ADVERTISE_PACKET_callback(data, len, src, dest);
-      leds_single_off(LEDS_LED2);
-      break;
-    case HEARTBEAT_PACKET:
-      HEARTBEAT_PACKET_callback(data, len, src, dest);
-      leds_single_off(LEDS_LED2);
-      break;
-    case NEWNODE_PACKET:
-      NEWNODE_PACKET_callback(data, len, src, dest);
-      leds_single_off(LEDS_LED2);
-      break;
-
-    default:
-      LOG_WARN("Unknown packet type: %d\r\n", type);
+  const newnode_packet *pkt = (const newnode_packet *)data;
+  static struct dio_packet offer;
+  // a running discovery will find it anyway
+  if(receive_newnode_before || !net_is_stable)
+  {
+    LOG_INFO("I have received the NewNode Pacekt\r\n");
+    return;
   }
+  offer.type = PKT_HDR(HELLO_PACKET);
+  linkaddr_copy(&offer.src, &linkaddr_node_addr);
+  linkaddr_copy(&offer.src_master, &linkaddr_node_addr);
+  offer.hop_count = 0;
+  offer.seq_id = last_seq_id;
+  memset(offer.scope, 0xFF, SCOPE_BYTES);
+  LOG_INFO("Join offer to node %u\r\n", get_node_id_from_linkaddr(&pkt->src));
+  tx_queue_send(&pkt->src, &offer, sizeof(offer), TXQ_CLASS_CONTROL, NULL, NULL);
 }
 
-static uint8_t hello_process_cnt = 0;
 
+// Lengths are checked here, handlers may cast data right away. Handlers
+// flagged RX_USABLE_LINK only see frames from links the estimator accepts.
+// HELLOs of other sinks, adverts and our own cluster map and mode floods
+// come back from relaying workers and are only counted. NEWNODE is judged
+// on RSSI alone, a newcomer has no history with us.
+static const rx_handler_entry rx_handlers[] = {
+  { HELLO_PACKET,       0, sizeof(struct dio_packet), sizeof(struct dio_packet), NULL },
+  { RT_REPORT_PACKET,   RX_USABLE_LINK, sizeof(struct rt_entry_pkt), sizeof(struct rt_entry_pkt), DAO_PACKET_callback },
+  { SENSOR_DATA_PACKET, RX_USABLE_LINK, sizeof(sensor_data), sizeof(sensor_data), SENSOR_PACKET_callback },
+  { ADVERTISE_PACKET,   0, sizeof(struct advertise_packet), sizeof(struct advertise_packet), NULL },
+  { HEARTBEAT_PACKET,   0, sizeof(heartbeat_packet), sizeof(heartbeat_packet), HEARTBEAT_PACKET_callback },
+  { NEWNODE_PACKET,     RX_RSSI_ONLY, sizeof(newnode_packet), sizeof(newnode_packet), NEWNODE_PACKET_callback },
+  { REFRESH_PACKET,     0, sizeof(refresh_packet), sizeof(refresh_packet), REFRESH_PACKET_callback },
+  { CLUSTER_MAP_PACKET, 0, CLUSTER_MAP_HDR_LEN, sizeof(cluster_map_packet), NULL },
+  { SENSOR_AGG_PACKET,  RX_USABLE_LINK, SENSOR_AGG_HDR_LEN, sizeof(sensor_agg_packet), SENSOR_AGG_PACKET_callback },
+  { SENSOR_MODE_PACKET, 0, sizeof(sensor_mode_packet), sizeof(sensor_mode_packet), NULL },
+  { SENSOR_COMPACT_PACKET, 0, SENSOR_COMPACT_HDR_LEN, sizeof(sensor_compact_packet), SENSOR_COMPACT_PACKET_callback },
+};
 
 PROCESS(hello_process, "HELLO Flooding Process");
 PROCESS(delivery_ch_process, "choosing CH Process");
 PROCESS(heartbeat_hearing_process, "Master uses this process to monitor node lost");
+PROCESS(command_process, "Commands from the host");
 
 
-AUTOSTART_PROCESSES(&hello_process, &delivery_ch_process,&heartbeat_hearing_process);
+AUTOSTART_PROCESSES(&hello_process, &delivery_ch_process,&heartbeat_hearing_process,
+                    &command_process);
                               
 PROCESS_THREAD(hello_process, ev, data) {
   static struct etimer timer;
-  static struct dio_packet my_hello_pkt;
 
   PROCESS_BEGIN();
   LOG_INFO("HELLO PROCESS BEGIN\n");
@@ -555,39 +1123,55 @@ PROCESS_THREAD(hello_process, ev, data) {
     LOG_INFO("TX power set to %d dBm\n", TX_POWER);
   }
 
-  //get_index_from_addr(&linkaddr_node_addr);
-
-  memb_init(&rt_mem);
-  list_init(local_rt_table);
-  insert_entry_to_rt_table(&linkaddr_node_addr, &linkaddr_node_addr, 0, 0, 0);
-  for (int i = 0; i < MAX_NODES; i++) {
-    for (int j = 0; j < MAX_NODES; j++) {
-      adjacency_matrix[i][j] = (i == j) ? 255 : 0;
+  // a sink other than node 0 takes index 0 in its own numbering, workers
+  // swap the two indices back for everything it sends
+  for(int k = 1; k < MAX_NODES; k++)
+  {
+    if(linkaddr_cmp(&node_index_to_addr[k], &linkaddr_node_addr))
+    {
+      linkaddr_t tmp = node_index_to_addr[0];
+      node_index_to_addr[0] = node_index_to_addr[k];
+      node_index_to_addr[k] = tmp;
+      my_global_index = k;
     }
   }
+
+  // each round carries its own seq so workers can tell floods apart,
+  // a new discovery restarts from 1
+  reset_discovery();
+  if(restore_state())
+  {
+    // workers keep their parents across our reboot, just carry on; lost
+    // nodes show up through the heartbeats as usual
+    LOG_INFO("Restored topology version %u, skipping discovery\n\r", topology_version);
+    rebuild_permanent_rt_table();
+    last_recluster = clock_time();
+    net_is_stable = 1;
+  }
  
-  nullnet_set_input_callback(HELLO_Callback);
+  link_est_init();
+  tx_queue_init();
+  rx_dispatch_init(rx_handlers, sizeof(rx_handlers) / sizeof(rx_handlers[0]));
+#if NET_STATS
+  rx_dispatch_print_budget();
+#endif
+  nullnet_set_input_callback(rx_dispatch_input);
   etimer_set(&timer, CLOCK_SECOND * HELLO_INTERVAL);
   while(1) {
-    last_seq_id = 1;
     PROCESS_WAIT_EVENT_UNTIL(etimer_expired(&timer));
     if(!net_is_stable) {
         battery_i[0] =  get_millivolts(saadc_sensor.value(BATTERY_SENSOR));
-        memset(known_nodes, 0, sizeof(known_nodes));
-        if(hello_process_cnt >= 5) {
+        if(discovery_converged()) {
+          LOG_INFO("HELLO process complete after %u rounds, %d nodes. Exiting.\n",
+                   hello_process_cnt, count_known_nodes());
           hello_process_cnt = 0;
           receive_newnode_before = 0;
+          recluster_needed = 1;
           net_is_stable = 1;
-          LOG_INFO("HELLO process complete. Exiting.\n");
           //PROCESS_EXIT();  
         }
         leds_single_on(LEDS_LED1);
-        my_hello_pkt.type = HELLO_PACKET;
-        linkaddr_copy(&my_hello_pkt.src, &linkaddr_node_addr);
-        linkaddr_copy(&my_hello_pkt.src_master, &linkaddr_node_addr);
-        my_hello_pkt.hop_count = 0;
-        my_hello_pkt.seq_id = last_seq_id++;
-        forward_hello(&my_hello_pkt);
+        broadcast_hello(NULL);
         LOG_INFO("MASTER broadcasted HELLO %d\r\n", hello_process_cnt++);
         leds_single_off(LEDS_LED1);
       }
@@ -605,39 +1189,31 @@ PROCESS_THREAD(delivery_ch_process, ev, data)
   etimer_set(&choose_timer, CLOCK_SECOND*3);
 	while(1){
 		PROCESS_WAIT_EVENT();
-    if(net_is_stable)
+    if(net_is_stable && repair_pending)
+    {
+      continue_local_repair();
+    }
+    else if(net_is_stable && (recluster_needed || clock_time() - last_recluster >= RECLUSTER_INTERVAL))
     {
       unsigned char head_list[3] ={0};
       short* rssi = (short*)adjacency_matrix;
-      volatile static unsigned char link_table[MAX_NODES*MAX_NODES]= {0};
       //print_local_routing_table();
       print_adjacency_matrix();
       // todo the adjacency_matrix need to stable, rssi need to large -30
       for(int i=0; i<MAX_NODES; i++){
         battery_f[i] = (float)battery_i[i]/3700;
       }
+      // links are only ever set by from_rssi_to_link, start from a clean table
+      memset(link_table, 0, sizeof(link_table));
       from_rssi_to_link(rssi, battery_f, MAX_NODES, (uint8_t*)link_table,head_list);
-      memb_init(&permanent_rt_mem);
-      list_init(permanent_rt_table);
-      LOG_INFO("+------------------+ Permanent Routing Table: +--------------------+\n");
-      for(int i=1;i<MAX_NODES;i++)
-      {
-        rt_entry *e = memb_alloc(&permanent_rt_mem);
-        if(e != NULL) {
-          linkaddr_copy(&e->dest, &node_index_to_addr[i]);
-          linkaddr_copy(&e->next_hop, &node_index_to_addr[get_direct_link((uint8_t*)link_table,i)]);
-          e->tot_hop = get_hop((uint8_t*)link_table,i);
-          e->metric = rssi[get_direct_link((uint8_t*)link_table,i)];
-          e->seq_no = 1;
-          list_add(permanent_rt_table, e);
-          LOG_INFO("|No.%d | dest:%d | next:%d | tot_hop:%u | rssi:%d | seq:%u |\n",
-                i, i, get_direct_link((uint8_t*)link_table,i),
-                e->tot_hop, e->metric, e->seq_no);
-          }
-      }
-      LOG_INFO("+------------------+ ------------------------ +--------------------+\n");
-      advertise_node_addr((uint8_t*)link_table,head_list); 
-	  }
+      rebuild_permanent_rt_table();
+      recluster_needed = 0;
+      last_recluster = clock_time();
+    }
+    if(net_is_stable && !repair_pending)
+    {
+      advertise_node_addr();
+    }
     etimer_reset(&choose_timer);
   }
 	PROCESS_END();
@@ -654,28 +1230,31 @@ PROCESS_THREAD(heartbeat_hearing_process, ev, data){
     if(net_is_stable)
     {
       for(int i=0;i<MAX_NODES;i++){
-        if(heart_record[i] >= TOLERANCE && known_nodes[i]==1){
-          memset(&heart_record, 0, MAX_NODES);
+        if(heart_record[i] >= TOLERANCE && known_nodes[i]==1 && !repair_pending){
+          heart_record[i] = 0;
           Node_death = 1;
-          LOG_INFO("Discover NewNode, begin to reorganise\r\n");
-          receive_newnode_before = 1;
-          net_is_stable = 0;
-          memb_init(&rt_mem);
-          list_init(local_rt_table);
-
-          insert_entry_to_rt_table(&linkaddr_node_addr, &linkaddr_node_addr, 0, 0, 0);
-          for (int i = 0; i < MAX_NODES; i++) {
-            for (int j = 0; j < MAX_NODES; j++) {
-              adjacency_matrix[i][j] = (i == j) ? 255 : 0;
-            }
-          }
-          last_seq_id = 1;
+          LOG_INFO("Node %d lost, repairing its subtree\r\n", i);
+          start_local_repair(i);
           break;
         }
         else{
           heart_record[i] ++ ;
         }
       }
+#if NET_STATS
+      tx_queue_print_stats();
+      rx_dispatch_print_stats();
+      sensor_codec_print_stats();
+#endif
+      // for the host merging several sinks: who we are and whom we serve,
+      // in the shared numbering like the sample lines
+      printf("SinkState: %u %u", my_global_index, topology_version);
+      for(int i=1;i<MAX_NODES;i++){
+        if(get_hop(link_table, i) >= 0){
+          printf(" %d", host_index(i));
+        }
+      }
+      printf("\r\n");
       etimer_reset(&et);
     }
     else{
@@ -683,4 +1262,26 @@ PROCESS_THREAD(heartbeat_hearing_process, ev, data){
     }
   }
   PROCESS_END();
-}
\ No newline at end of file
+}
+
+// One command per line from the host:
+//   RawMode: <node> <0|1>            raw sample feed of a node
+//   SampleRate: <node> <min> <max>   sample period bounds in seconds
+// node 255 addresses all nodes
+PROCESS_THREAD(command_process, ev, data){
+  PROCESS_BEGIN();
+  while(1)
+  {
+    PROCESS_WAIT_EVENT_UNTIL(ev == serial_line_event_message);
+    int node, raw, period_min, period_max;
+    if(sscanf((const char *)data, "RawMode: %d %d", &node, &raw) == 2)
+    {
+      send_sensor_mode(node, raw, 0, 0);
+    }
+    else if(sscanf((const char *)data, "SampleRate: %d %d %d", &node, &period_min, &period_max) == 3)
+    {
+      send_sensor_mode(node, SENSOR_MODE_KEEP, period_min, period_max);
+    }
+  }
+  PROCESS_END();
+}
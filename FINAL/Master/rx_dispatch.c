@@ -0,0 +1,113 @@
+/**
+ * @file    rx_dispatch.c
+ * @brief   table driven dispatch of received frames
+ */
+
+#include "rx_dispatch.h"
+#include "link_estimator.h"
+#include "net/packetbuf.h"
+#include "dev/leds.h"
+#include <stdio.h>
+#include <string.h>
+
+static const rx_handler_entry *by_type[PKT_TYPE_COUNT];
+static rx_stats stats;
+
+// The table is kept, not copied; it has to stay valid.
+void rx_dispatch_init(const rx_handler_entry *table, uint8_t cnt)
+{
+    memset(by_type, 0, sizeof(by_type));
+    memset(&stats, 0, sizeof(stats));
+    for (int i = 0; i < cnt; i++) {
+        if (table[i].type < PKT_TYPE_COUNT) {
+            by_type[table[i].type] = &table[i];
+        }
+    }
+}
+
+static int link_ok(const rx_handler_entry *h, const linkaddr_t *src,
+                   const linkaddr_t *dest, int8_t rssi)
+{
+    uint8_t flags = h->flags;
+    if ((flags & RX_UNICAST_RSSI) && linkaddr_cmp(dest, &linkaddr_node_addr)) {
+        flags = RX_RSSI_ONLY;
+    }
+    if (flags & RX_RSSI_ONLY) {
+        return rssi >= LINK_EST_RSSI_ADD;
+    }
+    if (flags & RX_USABLE_LINK) {
+        return link_est_usable(src);
+    }
+    return 1;
+}
+
+void rx_dispatch_input(const void *data, uint16_t len,
+                       const linkaddr_t *src, const linkaddr_t *dest)
+{
+    if (len == 0) {
+        stats.unknown++;
+        return;
+    }
+    // every frame is a sample of the link to its sender
+    int8_t rssi = (int8_t)packetbuf_attr(PACKETBUF_ATTR_RSSI);
+    link_est_rx(src, rssi);
+
+    uint8_t hdr = *(const uint8_t *)data;
+    if (PKT_HDR_VERSION(hdr) != PKT_VERSION) {
+        stats.bad_version++;
+        return;
+    }
+    uint8_t type = PKT_HDR_TYPE(hdr);
+    const rx_handler_entry *h = type < PKT_TYPE_COUNT ? by_type[type] : NULL;
+    if (h == NULL) {
+        stats.unknown++;
+        return;
+    }
+    rx_type_stats *ts = &stats.type[type];
+    if (len < h->min_len || len > h->max_len) {
+        ts->bad_len++;
+        return;
+    }
+    if (!link_ok(h, src, dest, rssi)) {
+        ts->bad_link++;
+        return;
+    }
+    ts->rx++;
+    if (h->handler != NULL) {
+        leds_single_on(LEDS_LED2);
+        h->handler(data, len, src, dest);
+        leds_single_off(LEDS_LED2);
+    }
+}
+
+const rx_stats* rx_dispatch_stats(void)
+{
+    return &stats;
+}
+
+// one rx/bad_len/bad_link triple per packet type that was seen at all
+void rx_dispatch_print_stats(void)
+{
+    printf("RX bad version %u unknown %u |", stats.bad_version, stats.unknown);
+    for (int t = 0; t < PKT_TYPE_COUNT; t++) {
+        const rx_type_stats *ts = &stats.type[t];
+        if (ts->rx || ts->bad_len || ts->bad_link) {
+            printf(" %d: %u/%u/%u", t, ts->rx, ts->bad_len, ts->bad_link);
+        }
+    }
+    printf("\n");
+}
+
+// Largest accepted frame per type against what a single frame can carry,
+// printed once at boot.
+void rx_dispatch_print_budget(void)
+{
+    printf("Wire budget, %d byte frame payload:", WIRE_FRAME_PAYLOAD);
+    for (int t = 0; t < PKT_TYPE_COUNT; t++) {
+        const rx_handler_entry *h = by_type[t];
+        if (h != NULL) {
+            printf(" %d: %u (%d left)", t, h->max_len, WIRE_FRAME_PAYLOAD - (int)h->max_len);
+        }
+    }
+    printf("\n");
+}
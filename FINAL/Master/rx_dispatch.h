@@ -0,0 +1,58 @@
+/**
+ * @file    rx_dispatch.h
+ * @brief   table driven dispatch of received frames
+ * @details checks the header byte, the length and the link of every frame
+ *          against the handler table before the handler sees it, and counts
+ *          what was delivered and what was dropped per packet type
+***/
+
+#ifndef RX_DISPATCH_H
+#define RX_DISPATCH_H
+
+#include "contiki.h"
+#include "net/linkaddr.h"
+#include "packet_structure.h"
+
+// same signature as the nullnet input callback
+typedef void (*rx_handler_t)(const void *data, uint16_t len,
+                             const linkaddr_t *src, const linkaddr_t *dest);
+
+// drop the frame unless link_est_usable(src)
+#define RX_USABLE_LINK  0x01
+// bootstrap frames: only their own RSSI has to reach LINK_EST_RSSI_ADD,
+// the sender may have no history with us yet
+#define RX_RSSI_ONLY    0x02
+// with RX_USABLE_LINK: a unicast to us is checked as RX_RSSI_ONLY
+#define RX_UNICAST_RSSI 0x04
+
+typedef struct rx_handler_entry
+{
+    uint8_t type;
+    uint8_t flags;
+    uint16_t min_len;
+    uint16_t max_len;
+    rx_handler_t handler;   // NULL: known type, counted and ignored
+}rx_handler_entry;
+
+typedef struct rx_type_stats
+{
+    uint16_t rx;            // passed all checks
+    uint16_t bad_len;
+    uint16_t bad_link;
+}rx_type_stats;
+
+typedef struct rx_stats
+{
+    rx_type_stats type[PKT_TYPE_COUNT];
+    uint16_t bad_version;
+    uint16_t unknown;
+}rx_stats;
+
+void rx_dispatch_init(const rx_handler_entry *table, uint8_t cnt);
+void rx_dispatch_input(const void *data, uint16_t len,
+                       const linkaddr_t *src, const linkaddr_t *dest);
+const rx_stats* rx_dispatch_stats(void);
+void rx_dispatch_print_stats(void);
+void rx_dispatch_print_budget(void);
+
+#endif
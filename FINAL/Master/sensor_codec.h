@@ -0,0 +1,47 @@
+/**
+ * @file    sensor_codec.h
+ * @brief   delta encoding of a node's own samples for one hop
+ * @details the sender keeps the last sample its next hop acknowledged and
+ *          only sends what changed against it, as single bytes where the
+ *          change fits; the receiver keeps the last sample it decoded per
+ *          sender. Anything that could leave the two out of step (a lost
+ *          ACK, a new next hop, a frame still waiting for its ACK) makes
+ *          the next frame a full one, and every SENSOR_COMPACT_FULL_EVERY
+ *          frames one is sent anyway
+***/
+
+#ifndef SENSOR_CODEC_H
+#define SENSOR_CODEC_H
+
+#include "contiki.h"
+#include "net/linkaddr.h"
+#include "packet_structure.h"
+
+typedef struct sensor_enc
+{
+    linkaddr_t peer;        // next hop the reference is shared with
+    sensor_sample ref;      // last sample the peer acknowledged
+    sensor_sample sent;     // newest sample sent
+    uint8_t has_ref;
+    uint8_t pending;        // frames waiting for their MAC result
+    uint8_t since_full;     // delta frames since the last full one
+}sensor_enc;
+
+typedef struct sensor_dec
+{
+    sensor_sample ref;      // last sample decoded from the sender
+    uint8_t has_ref;
+}sensor_dec;
+
+// frame for s into pkt, returns its length
+uint16_t sensor_encode(sensor_enc *enc, const linkaddr_t *peer,
+                       const sensor_sample *s, sensor_compact_packet *pkt);
+// MAC result of the frame with that seq, also when it never got queued
+void sensor_encode_done(sensor_enc *enc, uint8_t seq, int acked);
+// 0 and the sample in out, -1 if the frame is malformed or its base is
+// not the sample we hold
+int sensor_decode(sensor_dec *dec, const void *data, uint16_t len,
+                  sensor_sample *out);
+void sensor_codec_print_stats(void);
+
+#endif
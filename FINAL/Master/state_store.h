@@ -0,0 +1,22 @@
+/**
+ * @file    state_store.h
+ * @brief   one persistent state record in a dedicated flash page
+ * @details on the nrf52840 the record lives in the last flash page and is
+ *          written through the NVMC. New records are appended behind the
+ *          old ones, the page is only erased once it is full. Other
+ *          targets have no store and always start cold.
+***/
+
+#ifndef STATE_STORE_H
+#define STATE_STORE_H
+
+#include "contiki.h"
+
+// Copies the newest record into data. Returns 1 if it has exactly len
+// bytes and a good checksum, 0 otherwise.
+int state_store_read(void *data, uint16_t len);
+// Returns 0 when written, -1 without a store or when len does not fit.
+int state_store_write(const void *data, uint16_t len);
+void state_store_erase(void);
+
+#endif
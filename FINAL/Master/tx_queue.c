@@ -0,0 +1,132 @@
+/**
+ * @file    tx_queue.c
+ * @brief   bounded transmit queue in front of the MAC
+ */
+
+#include "tx_queue.h"
+#include "net/netstack.h"
+#include "lib/list.h"
+#include "lib/memb.h"
+#include <stdio.h>
+#include <string.h>
+
+MEMB(txq_mem, txq_entry, TXQ_SIZE);
+LIST(txq_control);
+LIST(txq_routing);
+LIST(txq_data);
+
+static list_t class_list[TXQ_NUM_CLASSES];
+static const uint8_t class_limit[TXQ_NUM_CLASSES] = {
+    TXQ_LIMIT_CONTROL, TXQ_LIMIT_ROUTING, TXQ_LIMIT_DATA
+};
+static txq_entry *in_flight;
+static txq_stats stats;
+
+static void transmit_next(void);
+
+static void txq_sent(void *ptr, int status, int transmissions)
+{
+    txq_entry *e = (txq_entry *)ptr;
+    if (status == MAC_TX_OK) {
+        stats.sent_ok++;
+    } else {
+        stats.sent_fail++;
+    }
+    in_flight = NULL;
+    stats.depth--;
+    if (e->done != NULL) {
+        e->done(e->ptr, status, transmissions);
+    }
+    memb_free(&txq_mem, e);
+    transmit_next();
+}
+
+static void transmit_next(void)
+{
+    if (in_flight != NULL) {
+        return;
+    }
+    for (int c = 0; c < TXQ_NUM_CLASSES; c++) {
+        txq_entry *e = list_pop(class_list[c]);
+        if (e == NULL) {
+            continue;
+        }
+        in_flight = e;
+        packetbuf_clear();
+        packetbuf_copyfrom(e->buf, e->len);
+        packetbuf_set_addr(PACKETBUF_ADDR_RECEIVER, &e->dest);
+        packetbuf_set_addr(PACKETBUF_ADDR_SENDER, &linkaddr_node_addr);
+        NETSTACK_MAC.send(txq_sent, e);
+        return;
+    }
+}
+
+void tx_queue_init(void)
+{
+    memb_init(&txq_mem);
+    class_list[TXQ_CLASS_CONTROL] = txq_control;
+    class_list[TXQ_CLASS_ROUTING] = txq_routing;
+    class_list[TXQ_CLASS_DATA] = txq_data;
+    for (int c = 0; c < TXQ_NUM_CLASSES; c++) {
+        list_init(class_list[c]);
+    }
+    in_flight = NULL;
+    memset(&stats, 0, sizeof(stats));
+}
+
+// Copies the frame, so the caller's buffer is free again on return.
+// Returns 0 when queued, -1 when dropped; done is only called for
+// queued frames.
+int tx_queue_send(const linkaddr_t *dest, const void *data, uint16_t len,
+                  uint8_t cls, mac_callback_t done, void *ptr)
+{
+    if (cls >= TXQ_NUM_CLASSES || len > PACKETBUF_SIZE) {
+        return -1;
+    }
+    if (list_length(class_list[cls]) >= class_limit[cls]) {
+        stats.dropped[cls]++;
+        return -1;
+    }
+    txq_entry *e = memb_alloc(&txq_mem);
+    if (e == NULL) {
+        stats.dropped[cls]++;
+        return -1;
+    }
+    e->cls = cls;
+    linkaddr_copy(&e->dest, dest != NULL ? dest : &linkaddr_null);
+    e->done = done;
+    e->ptr = ptr;
+    e->len = len;
+    memcpy(e->buf, data, len);
+    list_add(class_list[cls], e);
+    stats.queued[cls]++;
+    stats.depth++;
+    if (stats.depth > stats.max_depth) {
+        stats.max_depth = stats.depth;
+    }
+    transmit_next();
+    return 0;
+}
+
+// Forward the frame a receive callback is looking at. The callback edits
+// it in place in packetbuf (hop count, route position) and hands it over
+// here; the queue entry is its only copy. The callback must not touch the
+// packet afterwards, packetbuf may already hold the next frame to send.
+int tx_queue_forward(const linkaddr_t *dest, uint8_t cls, mac_callback_t done, void *ptr)
+{
+    return tx_queue_send(dest, packetbuf_dataptr(), packetbuf_datalen(), cls, done, ptr);
+}
+
+const txq_stats* tx_queue_stats(void)
+{
+    return &stats;
+}
+
+void tx_queue_print_stats(void)
+{
+    printf("TXQ depth %u max %u ok %u fail %u | queued/dropped ctrl %u/%u rt %u/%u data %u/%u\n",
+           stats.depth, stats.max_depth, stats.sent_ok, stats.sent_fail,
+           stats.queued[TXQ_CLASS_CONTROL], stats.dropped[TXQ_CLASS_CONTROL],
+           stats.queued[TXQ_CLASS_ROUTING], stats.dropped[TXQ_CLASS_ROUTING],
+           stats.queued[TXQ_CLASS_DATA], stats.dropped[TXQ_CLASS_DATA]);
+}
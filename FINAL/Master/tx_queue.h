@@ -0,0 +1,57 @@
+/**
+ * @file    tx_queue.h
+ * @brief   bounded transmit queue in front of the MAC
+ * @details frames are copied into pool entries and sent one at a time,
+ *          control first, then routing, then data; each class has its
+ *          own limit so a burst of one kind can not starve the others
+***/
+
+#ifndef TX_QUEUE_H
+#define TX_QUEUE_H
+
+#include "contiki.h"
+#include "net/linkaddr.h"
+#include "net/packetbuf.h"
+#include "net/mac/mac.h"
+
+// in sending order
+enum
+{
+    TXQ_CLASS_CONTROL,  // HELLO, adverts, cluster map, refresh, join offers
+    TXQ_CLASS_ROUTING,  // routing reports
+    TXQ_CLASS_DATA,     // sensor data and heartbeats
+    TXQ_NUM_CLASSES
+};
+
+typedef struct txq_entry
+{
+    struct txq_entry *next;
+    uint8_t cls;
+    linkaddr_t dest;        // linkaddr_null for broadcast
+    mac_callback_t done;    // called with the MAC result, may be NULL
+    void *ptr;
+    uint16_t len;
+    uint8_t buf[PACKETBUF_SIZE];
+}txq_entry;
+
+typedef struct txq_stats
+{
+    uint16_t queued[TXQ_NUM_CLASSES];
+    uint16_t dropped[TXQ_NUM_CLASSES];
+    uint16_t sent_ok;
+    uint16_t sent_fail;
+    uint8_t depth;
+    uint8_t max_depth;
+}txq_stats;
+
+void tx_queue_init(void);
+// Either call may send right away and reuse the packetbuf. From an RX
+// callback, data, src and dest are invalid afterwards: copy what is still
+// needed first.
+int tx_queue_send(const linkaddr_t *dest, const void *data, uint16_t len,
+                  uint8_t cls, mac_callback_t done, void *ptr);
+int tx_queue_forward(const linkaddr_t *dest, uint8_t cls, mac_callback_t done, void *ptr);
+const txq_stats* tx_queue_stats(void);
+void tx_queue_print_stats(void);
+
+#endif
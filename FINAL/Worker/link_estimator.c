@@ -0,0 +1,154 @@
+/**
+ * @file    link_estimator.c
+ * @brief   per-neighbour link quality estimation
+ */
+
+#include "link_estimator.h"
+#include "net/mac/mac.h"
+#include <string.h>
+
+static link_stats link_table_est[LINK_EST_TABLE_SIZE];
+
+// new = old * (1 - 1/DIV) + sample / DIV, rounded
+static int32_t ewma(int32_t old, int32_t sample)
+{
+    int32_t sum = old * (LINK_EST_ALPHA_DIV - 1) + sample;
+    return (sum >= 0 ? sum + LINK_EST_ALPHA_DIV / 2 : sum - LINK_EST_ALPHA_DIV / 2) / LINK_EST_ALPHA_DIV;
+}
+
+// A link has to get clearly good to be used and clearly bad to be dropped,
+// samples in between keep the previous decision.
+static void evaluate(link_stats *ls)
+{
+    int16_t rssi = link_est_rssi(ls);
+    uint16_t etx = link_est_etx(ls);
+    if (ls->usable) {
+        if (rssi < LINK_EST_RSSI_DROP || etx > LINK_EST_ETX_DROP) {
+            ls->usable = 0;
+        }
+    } else if (rssi >= LINK_EST_RSSI_ADD && etx <= LINK_EST_ETX_ADD) {
+        ls->usable = 1;
+    }
+}
+
+void link_est_init(void)
+{
+    memset(link_table_est, 0, sizeof(link_table_est));
+}
+
+link_stats* link_est_lookup(const linkaddr_t *addr)
+{
+    for (int i = 0; i < LINK_EST_TABLE_SIZE; i++) {
+        if (link_table_est[i].in_use && linkaddr_cmp(&link_table_est[i].addr, addr)) {
+            return &link_table_est[i];
+        }
+    }
+    return NULL;
+}
+
+// free slot, or the neighbour with the weakest signal
+static link_stats* allocate(void)
+{
+    link_stats *worst = &link_table_est[0];
+    for (int i = 0; i < LINK_EST_TABLE_SIZE; i++) {
+        if (!link_table_est[i].in_use) {
+            return &link_table_est[i];
+        }
+        if (link_table_est[i].rssi_x8 < worst->rssi_x8) {
+            worst = &link_table_est[i];
+        }
+    }
+    return worst;
+}
+
+link_stats* link_est_rx(const linkaddr_t *addr, int8_t rssi)
+{
+    link_stats *ls = link_est_lookup(addr);
+    if (ls == NULL) {
+        ls = allocate();
+        memset(ls, 0, sizeof(*ls));
+        linkaddr_copy(&ls->addr, addr);
+        ls->in_use = 1;
+        ls->rssi_x8 = rssi * LINK_EST_RSSI_SCALE;
+        ls->prr = 100;
+    } else {
+        ls->rssi_x8 = ewma(ls->rssi_x8, rssi * LINK_EST_RSSI_SCALE);
+    }
+    if (ls->samples < LINK_EST_MIN_SAMPLES) {
+        ls->samples++;
+    }
+    evaluate(ls);
+    return ls;
+}
+
+// Sequence numbers from one sender: every skipped number is a lost frame.
+void link_est_rx_seq(const linkaddr_t *addr, uint8_t seq)
+{
+    link_stats *ls = link_est_lookup(addr);
+    if (ls == NULL) {
+        return;
+    }
+    uint8_t gap = seq - ls->last_seq;
+    ls->last_seq = seq;
+    if (!ls->has_seq || gap > LINK_EST_MAX_GAP) {
+        // first frame, or the sender restarted / just switched to us
+        ls->has_seq = 1;
+        return;
+    }
+    if (gap == 0) {
+        return;
+    }
+    for (int i = 1; i < gap; i++) {
+        ls->prr = ewma(ls->prr, 0);
+    }
+    ls->prr = ewma(ls->prr, 100);
+    evaluate(ls);
+}
+
+// Result of a unicast to addr, as reported by the MAC sent callback.
+void link_est_tx(const linkaddr_t *addr, int status, int transmissions)
+{
+    link_stats *ls = link_est_lookup(addr);
+    if (ls == NULL) {
+        return;
+    }
+    int32_t sample = (status == MAC_TX_OK ? transmissions : LINK_EST_ETX_NOACK) * LINK_EST_ETX_SCALE;
+    if (!ls->tx_seen) {
+        ls->etx_x16 = sample;
+        ls->tx_seen = 1;
+    } else {
+        ls->etx_x16 = ewma(ls->etx_x16, sample);
+    }
+    evaluate(ls);
+}
+
+int16_t link_est_rssi(const link_stats *ls)
+{
+    return ls->rssi_x8 / LINK_EST_RSSI_SCALE;
+}
+
+// Without own transmissions on the link assume it is symmetric.
+uint16_t link_est_etx(const link_stats *ls)
+{
+    if (ls->tx_seen) {
+        return ls->etx_x16;
+    }
+    if (ls->prr == 0) {
+        return 0xFFFF;
+    }
+    return 100 * LINK_EST_ETX_SCALE / ls->prr;
+}
+
+int link_est_usable(const linkaddr_t *addr)
+{
+    link_stats *ls = link_est_lookup(addr);
+    return ls != NULL && ls->usable;
+}
+
+// Usable links carry frames; a neighbour is only reported as adjacent, and
+// so only ever becomes a parent, after LINK_EST_MIN_SAMPLES frames from it.
+int link_est_adjacent(const linkaddr_t *addr)
+{
+    link_stats *ls = link_est_lookup(addr);
+    return ls != NULL && ls->usable && ls->samples >= LINK_EST_MIN_SAMPLES;
+}
@@ -0,0 +1,42 @@
+/**
+ * @file    link_estimator.h
+ * @brief   per-neighbour link quality estimation
+ * @details smoothed RSSI, packet reception ratio from sequence gaps and
+ *          ETX from link-layer ACKs, with hysteresis on link usability
+***/
+
+#ifndef LINK_ESTIMATOR_H
+#define LINK_ESTIMATOR_H
+
+#include "contiki.h"
+#include "net/linkaddr.h"
+
+// fixed point: RSSI is kept times 8, ETX times 16
+#define LINK_EST_RSSI_SCALE 8
+#define LINK_EST_ETX_SCALE  16
+
+typedef struct link_stats
+{
+    linkaddr_t addr;
+    uint8_t in_use;
+    uint8_t usable;         // hysteresis state, see link_est_usable()
+    uint8_t samples;        // frames received, saturates at LINK_EST_MIN_SAMPLES
+    int16_t rssi_x8;        // EWMA of received RSSI
+    uint8_t prr;            // EWMA of reception ratio in percent
+    uint8_t has_seq;
+    uint8_t last_seq;
+    uint8_t tx_seen;        // ETX from our own transmissions is known
+    uint16_t etx_x16;       // EWMA of transmissions per delivered frame
+}link_stats;
+
+void link_est_init(void);
+link_stats* link_est_lookup(const linkaddr_t *addr);
+link_stats* link_est_rx(const linkaddr_t *addr, int8_t rssi);
+void link_est_rx_seq(const linkaddr_t *addr, uint8_t seq);
+void link_est_tx(const linkaddr_t *addr, int status, int transmissions);
+int16_t link_est_rssi(const link_stats *ls);
+uint16_t link_est_etx(const link_stats *ls);
+int link_est_usable(const linkaddr_t *addr);
+int link_est_adjacent(const linkaddr_t *addr);
+
+#endif
@@ -1,6 +1,60 @@
 #ifndef PACKET_STRUCTURES_H
 #define PACKET_STRUCTURES_H
+#include <stddef.h>
+/*******************PACKET TYPES**********************/
+// First byte of every frame: protocol version in the top bits, packet type
+// below. Bump PKT_VERSION on any change of a wire layout, nodes then drop
+// frames of older firmware instead of misreading them. Versions up to 7
+// had five type bits, their frames decode as versions 14 and 15 here.
+#define PKT_VERSION           8
+#define PKT_TYPE_BITS         4
+#define PKT_HDR(type)         ((PKT_VERSION << PKT_TYPE_BITS) | (type))
+#define PKT_HDR_TYPE(hdr)     ((hdr) & ((1 << PKT_TYPE_BITS) - 1))
+#define PKT_HDR_VERSION(hdr)  ((hdr) >> PKT_TYPE_BITS)
+
+enum
+{
+  HELLO_PACKET       = 1,  // broadcast to build neighbour and route tables
+  RT_REPORT_PACKET   = 2,
+  SENSOR_DATA_PACKET = 3,
+  ADVERTISE_PACKET   = 4,
+  HEARTBEAT_PACKET   = 5,
+  NEWNODE_PACKET     = 6,
+  REFRESH_PACKET     = 7,
+  CLUSTER_MAP_PACKET = 8,
+  SENSOR_AGG_PACKET  = 9,
+  SENSOR_MODE_PACKET = 10,
+  SENSOR_COMPACT_PACKET = 11,
+  PKT_TYPE_COUNT
+};
+_Static_assert(PKT_TYPE_COUNT <= (1 << PKT_TYPE_BITS), "packet types do not fit the header");
+_Static_assert(PKT_VERSION < (1 << (8 - PKT_TYPE_BITS)), "PKT_VERSION does not fit the header");
+
 /*******************STRUCTURES**********************/
+// bitmap over node indices, used to address part of the network
+#define SCOPE_BYTES ((MAX_NODES + 7) / 8)
+
+// Wire structs are packed and only use fixed width fields, so the layout
+// is the same on every node and handlers can read frames in place. Each
+// one is followed by a check of its size; a field added without updating
+// the check (and PKT_VERSION) does not compile.
+#define WIRE_PACKED __attribute__((packed))
+#define WIRE_SIZE_CHECK(type, size) \
+  _Static_assert(sizeof(type) == (size), #type " changed its wire size")
+// MAC payload of a 127 byte 802.15.4 frame with long addresses, PAN ID
+// compression and FCS
+#define WIRE_FRAME_PAYLOAD 104
+
+// Values are clamped, not wrapped, when narrowed into a wire field.
+static inline uint16_t wire_u16(int32_t v)
+{
+  return v < 0 ? 0 : (v > 0xFFFF ? 0xFFFF : v);
+}
+static inline int8_t wire_i8(int32_t v)
+{
+  return v < INT8_MIN ? INT8_MIN : (v > INT8_MAX ? INT8_MAX : v);
+}
+
 // This structure is used routing table entries.
 // Total byte = 8 byte.
 typedef struct rt_entry{
@@ -15,19 +69,24 @@ typedef struct rt_entry{
 }rt_entry;
 
 
-typedef struct
+typedef struct WIRE_PACKED
 {
   uint8_t type;
   linkaddr_t src;
   linkaddr_t des;
+  uint8_t seq;                  // per sender, gaps give the link's PRR
+  uint16_t version;             // topology version the sender holds
+  uint8_t alive[SCOPE_BYTES];   // node indices heard from during the epoch
 }heartbeat_packet;
+WIRE_SIZE_CHECK(heartbeat_packet, 20 + SCOPE_BYTES);
 
 
-typedef struct newnode_packet
+typedef struct WIRE_PACKED newnode_packet
 {
   uint8_t type;  
   linkaddr_t src;
 }newnode_packet;
+WIRE_SIZE_CHECK(newnode_packet, 9);
 
 
 
@@ -41,30 +100,34 @@ typedef struct{
 }routing_table;
 
 
-struct rt_entry_pkt{
+struct WIRE_PACKED rt_entry_pkt{
 	uint8_t type;// Standard C includes:
 	linkaddr_t src;
+	linkaddr_t sink;		// the sink this report is for, relays of another sink drop it
 	uint8_t hop_count;
 	uint16_t seq_id;
-	int battery;  
+	uint16_t battery;		// mV
 	linkaddr_t rt_src;
 	linkaddr_t rt_dest;
 	linkaddr_t rt_next_hop;
 	uint8_t rt_tot_hop;		// Total hop number for this destination.
-	int16_t rt_metric;
+	int8_t rt_metric;		// RSSI in dBm
 	uint16_t rt_seq_no;
 	// used for constructiong the local routing table
 };
+WIRE_SIZE_CHECK(struct rt_entry_pkt, 50);
 
 
 //the packet used for intial the set-up process
-struct dio_packet {
+struct WIRE_PACKED dio_packet {
 	uint8_t type;
 	linkaddr_t src;
 	linkaddr_t src_master;                 // original sender (Master node)
 	uint8_t hop_count;             // current hop count from master
 	uint16_t seq_id;               // sequence ID to prevent loops
+	uint8_t scope[SCOPE_BYTES];    // bit per node index that should answer
   };
+WIRE_SIZE_CHECK(struct dio_packet, 20 + SCOPE_BYTES);
 
 
 /*
@@ -78,25 +141,167 @@ struct dao_packet {
 };
 */
 
-struct advertise_packet{
+// hop list from the master down to the destination, as node indices
+typedef struct WIRE_PACKED source_route
+{
+  uint8_t len;                   // number of hops, 0 = route by table lookup
+  uint8_t pos;                   // index of the hop receiving the packet
+  uint8_t hop[SOURCE_ROUTE_MAX_HOPS];
+}source_route;
+WIRE_SIZE_CHECK(source_route, 2 + SOURCE_ROUTE_MAX_HOPS);
+
+struct WIRE_PACKED advertise_packet{
 	uint8_t type;
+	linkaddr_t src_master;         // sink whose numbering the route uses
 	linkaddr_t dest;
 	linkaddr_t advertise_ch;      // current hop count from master
-	uint16_t tot_hop;
-	uint16_t seq_id;               // sequence ID to prevent loop
+	linkaddr_t backup_ch;         // linkaddr_null if there is none
+	uint8_t tot_hop;
+	uint8_t backup_hop;            // tot_hop when going through backup_ch
+	uint16_t version;              // topology version, bumped on every parent map change
+	source_route route;
 };
+WIRE_SIZE_CHECK(struct advertise_packet, 37 + sizeof(source_route));
+
+// worker asks the master to re-send its advertisement, or tells it that
+// it failed over to its backup parent
+typedef struct WIRE_PACKED refresh_packet
+{
+  uint8_t type;
+  linkaddr_t src;
+  uint16_t version;              // newest version the worker holds
+  linkaddr_t parent;             // parent switched to, linkaddr_null for a plain request
+}refresh_packet;
+WIRE_SIZE_CHECK(refresh_packet, 19);
+
+// one node of the flooded cluster map, indexed like node_index_to_addr
+typedef struct WIRE_PACKED cluster_map_entry
+{
+  uint8_t parent;                // NO_PARENT if the node is not assigned
+  uint8_t backup;                // NO_PARENT if there is none
+  uint8_t tot_hop;
+  uint8_t backup_hop;            // tot_hop through the backup
+}cluster_map_entry;
+WIRE_SIZE_CHECK(cluster_map_entry, 4);
+
+// only the first cnt entries are sent
+typedef struct WIRE_PACKED cluster_map_packet
+{
+  uint8_t type;
+  linkaddr_t src_master;
+  uint16_t version;
+  uint8_t frag;                  // fragment index
+  uint8_t frag_cnt;
+  uint8_t first;                 // node index of entry[0]
+  uint8_t cnt;
+  cluster_map_entry entry[CLUSTER_MAP_FRAG_ENTRIES];
+}cluster_map_packet;
+
+#define CLUSTER_MAP_HDR_LEN  offsetof(cluster_map_packet, entry)
+WIRE_SIZE_CHECK(cluster_map_packet, 15 + CLUSTER_MAP_FRAG_ENTRIES * sizeof(cluster_map_entry));
+_Static_assert(sizeof(cluster_map_packet) <= WIRE_FRAME_PAYLOAD, "CLUSTER_MAP_FRAG_ENTRIES too large for one frame");
 
 
-typedef struct sensor_data
+typedef struct WIRE_PACKED sensor_data
 {
     uint8_t type;
     linkaddr_t  source;
-    int light_lux;
-    int distance;
-    int battery;
-    int temperature;
+    uint16_t light_lux;
+    uint16_t distance;  // cm
+    uint16_t battery;   // mV
+    int8_t temperature; // C
+    uint8_t flags;
+    uint8_t seq;        // per source, lets sinks and the host drop duplicates
     /* data */
 }sensor_data;
+WIRE_SIZE_CHECK(sensor_data, 18);
+// sample taken just now, the packet also proves the source is alive
+#define SENSOR_FLAG_ALIVE     0x01
+// the node has decided on its bay, OCCUPIED holds the decision
+#define SENSOR_FLAG_OCC_KNOWN 0x02
+#define SENSOR_FLAG_OCCUPIED  0x04
+// sent because the decision just changed
+#define SENSOR_FLAG_OCC_EVENT 0x08
+// held back while there was no route, ALIVE is never set along with it
+#define SENSOR_FLAG_STORED    0x10
+
+// sampling settings of the nodes in scope, flooded
+typedef struct WIRE_PACKED sensor_mode_packet
+{
+    uint8_t type;
+    linkaddr_t src_master;
+    uint16_t seq;
+    uint8_t raw;                   // 1: every sample, 0: occupancy changes only
+    uint8_t period_min;            // s between samples, 0 keeps the current
+    uint8_t period_max;
+    uint8_t scope[SCOPE_BYTES];
+}sensor_mode_packet;
+WIRE_SIZE_CHECK(sensor_mode_packet, 14 + SCOPE_BYTES);
+// raw value that leaves the feed as it is
+#define SENSOR_MODE_KEEP      0xFF
+
+// one node's sample inside an aggregate, node indexed like the sink's table
+typedef struct WIRE_PACKED sensor_sample
+{
+    uint8_t node;
+    uint8_t seq;
+    uint8_t flags;
+    uint16_t light_lux;
+    uint16_t distance;
+    uint16_t battery;
+    int8_t temperature;
+    uint8_t age;                   // s since it was taken, saturates at 255
+}sensor_sample;
+WIRE_SIZE_CHECK(sensor_sample, 11);
+
+// samples a parent collected during one aggregation window, only the
+// first cnt are sent
+typedef struct WIRE_PACKED sensor_agg_packet
+{
+    uint8_t type;
+    linkaddr_t src;
+    uint8_t cnt;
+    sensor_sample sample[SENSOR_AGG_MAX];
+}sensor_agg_packet;
+
+#define SENSOR_AGG_HDR_LEN  offsetof(sensor_agg_packet, sample)
+WIRE_SIZE_CHECK(sensor_agg_packet, 10 + SENSOR_AGG_MAX * sizeof(sensor_sample));
+_Static_assert(sizeof(sensor_agg_packet) <= WIRE_FRAME_PAYLOAD, "SENSOR_AGG_MAX too large for one frame");
+
+static inline void sensor_sample_from(sensor_sample *s, uint8_t node, const sensor_data *msg)
+{
+    s->node = node;
+    s->seq = msg->seq;
+    s->flags = msg->flags;
+    s->light_lux = msg->light_lux;
+    s->distance = msg->distance;
+    s->battery = msg->battery;
+    s->temperature = msg->temperature;
+    s->age = 0;
+}
+
+// A node's own sample to its next hop only, the sender is the MAC source.
+// Fields in present are sent, in bit order: full width in a full frame,
+// otherwise as a signed byte against the sample with seq base, which the
+// next hop acknowledged. Fields left out did not change.
+#define SENSOR_COMPACT_LIGHT    0x01   // u16 lux
+#define SENSOR_COMPACT_DISTANCE 0x02   // u16 cm
+#define SENSOR_COMPACT_BATTERY  0x04   // u8 in SENSOR_COMPACT_BATT_STEP mV
+#define SENSOR_COMPACT_TEMP     0x08   // i8 C
+#define SENSOR_COMPACT_FLAGS    0x10   // u8, never a delta
+#define SENSOR_COMPACT_FULL     0x80   // no base, every field is sent
+#define SENSOR_COMPACT_BATT_STEP 20
+typedef struct WIRE_PACKED sensor_compact_packet
+{
+    uint8_t type;
+    uint8_t seq;
+    uint8_t base;
+    uint8_t present;
+    uint8_t field[7];              // longest: a full frame
+}sensor_compact_packet;
+
+#define SENSOR_COMPACT_HDR_LEN  offsetof(sensor_compact_packet, field)
+WIRE_SIZE_CHECK(sensor_compact_packet, 11);
 /********************ROUTING LIST*************************/
 
 
@@ -15,12 +15,47 @@
 
 // Max number of nodes in the network.
 #define MASTER_NODE_ID 64849
-#define RSSSI_TH     (-75)
 
 
 
+// Link estimator: per neighbour EWMA of RSSI and reception ratio, ETX
+// from our own ACKed unicasts. A link is used once it is better than the
+// ADD thresholds and dropped only when it gets worse than the DROP ones.
+// Frames are accepted on a usable link from the first one on, but a new
+// neighbour is not reported as adjacent before LINK_EST_MIN_SAMPLES frames.
+#define LINK_EST_TABLE_SIZE  MAX_NODES
+#define LINK_EST_MIN_SAMPLES 3
+#define LINK_EST_ALPHA_DIV   8      // a new sample weighs 1/8
+#define LINK_EST_RSSI_ADD    (-72)
+#define LINK_EST_RSSI_DROP   (-80)
+#define LINK_EST_ETX_ADD     (2 * LINK_EST_ETX_SCALE)
+#define LINK_EST_ETX_DROP    (4 * LINK_EST_ETX_SCALE)
+#define LINK_EST_ETX_NOACK   8      // a lost frame counts as 8 transmissions
+#define LINK_EST_MAX_GAP     16     // larger sequence jumps restart PRR
+
+// Transmit queue: pool entries shared by all classes, and how many frames
+// of each class may wait at most. Control goes out first, data last.
+#define TXQ_SIZE           12
+#define TXQ_LIMIT_CONTROL  4
+#define TXQ_LIMIT_ROUTING  MAX_NODES
+#define TXQ_LIMIT_DATA     4
+
 // heart beat
 #define TOLERANCE 5
+// Parents merge the heartbeats of their members into their own, one
+// summary per epoch goes up. Every hop adds up to one epoch of delay,
+// keep depth * HEARTBEAT_EPOCH well below TOLERANCE master ticks.
+#define HEARTBEAT_EPOCH (CLOCK_SECOND * 8)
+// Any acknowledged upstream frame counts as a heartbeat. The idle time
+// before an explicit one grows by an epoch per ACK up to the maximum and
+// drops back to one epoch on a missed ACK.
+#define HEARTBEAT_MAX_IDLE (CLOCK_SECOND * 24)
+
+// Sensor aggregation: a parent holds its members' samples for up to one
+// window and sends them upstream as a single SENSOR_AGG_PACKET, its own
+// sample joins while a window is open. 0 relays every sample on its own.
+#define SENSOR_AGG_WINDOW  (CLOCK_SECOND / 2)
+#define SENSOR_AGG_MAX     MAX_NODES
 
 
 
@@ -30,28 +65,123 @@
 #define DIS_THRES	10
 #define	LIGHT_THRES	100
 #define	TEM_THRES	10
+// Occupancy is decided on the node: taken while light is below
+// OCC_LIGHT_TH lux and distance below OCC_DISTANCE_TH cm, a change counts
+// once it held for OCC_CONFIRM_TIME. Only changes are reported, plus a
+// summary every OCC_KEEPALIVE; the master can turn on the raw feed.
+#define OCC_LIGHT_TH        100
+#define OCC_DISTANCE_TH     50
+#define OCC_CONFIRM_TIME    (CLOCK_SECOND * 5)
+#define OCC_KEEPALIVE       (CLOCK_SECOND * 60)
+// Smoothing: BUFFER_SIZE sample moving average of light and distance,
+// distance goes through a median first against IR spikes, temperature
+// through an EWMA with weight 1/2^TEMPERATURE_EWMA_SHIFT. The occupancy
+// inputs only flip once they are OCC_*_HYST past their threshold.
+#define DISTANCE_MEDIAN_LEN     3
+#define TEMPERATURE_EWMA_SHIFT  3
+#define OCC_LIGHT_HYST          20
+#define OCC_DISTANCE_HYST       5
+// Fast path: a raw sample FAST_*_DELTA away from the average starts
+// FAST_BURST_SAMPLES samples every FAST_BURST_INTERVAL, during which a new
+// state is confirmed after FAST_CONFIRM_TIME. The median still needs two
+// samples on the new side, a single spike is not reported.
+#define FAST_LIGHT_DELTA        80
+#define FAST_DISTANCE_DELTA     25
+#define FAST_BURST_SAMPLES      6
+#define FAST_BURST_INTERVAL     (CLOCK_SECOND / 4)
+#define FAST_CONFIRM_TIME       (CLOCK_SECOND / 2)
+// Adaptive sampling: SENSOR_PERIOD_MIN while the bay is busy or a value is
+// within SENSOR_NEAR_* of its threshold, doubling up to SENSOR_PERIOD_MAX
+// after every SENSOR_QUIET_TIME without. The master can set both bounds
+// per bay.
+#define SENSOR_PERIOD_MIN       (CLOCK_SECOND * 1)
+#define SENSOR_PERIOD_MAX       (CLOCK_SECOND * 24)
+#define SENSOR_QUIET_TIME       (CLOCK_SECOND * 60)
+#define SENSOR_NEAR_LIGHT       (2 * OCC_LIGHT_HYST)
+#define SENSOR_NEAR_DISTANCE    (2 * OCC_DISTANCE_HYST)
+// Between slow samples the distance alone is probed every
+// SENSOR_PROBE_INTERVAL, a jump of FAST_DISTANCE_DELTA takes a full sample
+// at once. This keeps an arrival under 2 s at any sampling period.
+#define SENSOR_PROBE_INTERVAL   CLOCK_SECOND
+// Own samples go to the next hop delta encoded, see sensor_codec.h; a full
+// frame at least every SENSOR_COMPACT_FULL_EVERY frames puts a next hop
+// that lost its reference back in step.
+#define SENSOR_COMPACT_FULL_EVERY 4
+// Samples that find no route are kept, up to SENSOR_STORE_MAX with the
+// oldest dropped first, and go up in batches once a route is back.
+#define SENSOR_STORE_MAX        16
 
 // Hello Process Parameters for system 
 #define HELLO_INTERVAL 5
 #define HELLO_SEQ_ID   100  
 
+// Flooding: every HELLO copy is forwarded at most once per (source, seq),
+// after a random delay, and only if fewer than K copies were overheard.
+#define FLOOD_JITTER_MAX    (CLOCK_SECOND / 4)
+#define FLOOD_CACHE_SIZE    4
+#define FLOOD_SUPPRESS_K    3
+#define FLOOD_CACHE_LIFETIME (CLOCK_SECOND * 2)  // a new discovery reuses seq 1
+
+// Discovery ends once no report has changed the topology for the settle
+// time (shorter when every expected node has reported), bounded by rounds.
+#define DISCOVERY_MIN_ROUNDS      2
+#define DISCOVERY_MAX_ROUNDS      15
+#define DISCOVERY_EXPECTED_NODES  (MAX_NODES - 1)
+#define DISCOVERY_SETTLE_TIME     (CLOCK_SECOND * 3)
+#define DISCOVERY_SETTLE_FAST     (CLOCK_SECOND * 1)
+#define DISCOVERY_RSSI_TOL        5
+// A node that missed discovery repeats NEWNODE every 15 s; an attached
+// worker offers a join to the same node at most once per holdoff, so every
+// retry is answered but duplicates are not.
+#define JOIN_OFFER_HOLDOFF        (CLOCK_SECOND * 5)
+
+// Cluster advertisement: sent only when the parent map changes, stamped
+// with a topology version. NO_PARENT marks a node without an assignment.
+#define NO_PARENT                 0xFF
+#define ADVERT_REFRESH_DELAY      (CLOCK_SECOND * 2)
+// UNICAST sends one ADVERTISE_PACKET per node, MAP floods the whole parent
+// array as CLUSTER_MAP_PACKETs of up to CLUSTER_MAP_FRAG_ENTRIES nodes each.
+#define ADVERTISE_MODE_UNICAST    0
+#define ADVERTISE_MODE_MAP        1
+#define ADVERTISE_MODE            ADVERTISE_MODE_MAP
+#define CLUSTER_MAP_FRAG_ENTRIES  22        // 15 + 22 * 4 bytes fill one frame
+// Downward packets carry the hop list from the master, relays just pop it.
+#define SOURCE_ROUTE_MAX_HOPS     (MAX_NODES - 1)
+// Every node also gets a backup parent; a worker switches to it after this
+// many upstream frames in a row went unacknowledged by the primary.
+#define ADJACENCY_RSSI_TH         (-75)
+#define PARENT_FAIL_THRESHOLD     3
+
+// Localized repair: a lost node's subtree is re-attached from the known
+// links, or after a HELLO scoped to the orphans; only after this many
+// delivery ticks without success the whole network is rediscovered.
+// Clusters are otherwise recomputed once per RECLUSTER_INTERVAL.
+#define REPAIR_MAX_ATTEMPTS       3
+#define RECLUSTER_INTERVAL        (CLOCK_SECOND * 300)
+
+// Multi-sink: up to MAX_SINKS nodes of node_index_to_addr run the master
+// firmware. Each sink numbers the network with itself at index 0, packets
+// to and from it use that numbering (see sink_index()). Workers follow the
+// sink with the fewest hops and move to another one only when it is at
+// least SINK_SWITCH_HOPS closer.
+#define MAX_SINKS                 2
+#define SINK_SWITCH_HOPS          1
+
+// Warm restart: routing state is written to flash whenever it changes
+// and reloaded at boot, see state_store.h. 0 always starts with a full
+// discovery, as do targets other than the nrf52840.
+#ifndef PERSIST_STATE
+#define PERSIST_STATE             1
+#endif
+#define STATE_MAGIC               0x5253
+
+// Counters of the TX queue, RX dispatch and sample codec on the serial line
+// every epoch, and the wire budget at boot. Off by default: the host GUI
+// logs every line it gets.
+#ifndef NET_STATS
+#define NET_STATS                 0
+#endif
 
 
-/************PACKET TYPES *****************/
-/*TYPE MAPPING
- * 0- set  
- * 1- Broadcast Hello packet
- 
- * */
-/* ==== BROADCAST MESSAGE TYPES ==== */
-#define HELLO_PACKET       1  // Initial broadcast to build neighbor and route table.
-
-
-/* ==== UNICAST MESSAGE TYPES  ====*/
-#define RT_REPORT_PACKET   2
-#define SENSOR_DATA_PACKET 3
-#define ADVERTISE_PACKET   4
-#define HEARTBEAT_PACKET   5
-#define NEWNODE_PACKET     6
 
 #endif /* PROJECT_CONF_H_ */
@@ -0,0 +1,179 @@
+/**
+ * @file    sensor_codec.c
+ * @brief   delta encoding of a node's own samples for one hop
+ */
+
+#include "sensor_codec.h"
+#include <stdio.h>
+#include <string.h>
+
+#define FIELD_BITS  (SENSOR_COMPACT_LIGHT | SENSOR_COMPACT_DISTANCE | \
+                     SENSOR_COMPACT_BATTERY | SENSOR_COMPACT_TEMP | \
+                     SENSOR_COMPACT_FLAGS)
+
+static struct
+{
+    uint16_t full;
+    uint16_t delta;
+    uint16_t bad;           // malformed or against a base we do not hold
+}stats;
+
+static uint8_t *put16(uint8_t *f, uint16_t v)
+{
+    f[0] = v & 0xFF;
+    f[1] = v >> 8;
+    return f + 2;
+}
+
+static uint16_t get16(const uint8_t *f)
+{
+    return f[0] | (f[1] << 8);
+}
+
+static int fits_i8(int32_t d)
+{
+    return d >= INT8_MIN && d <= INT8_MAX;
+}
+
+// The battery is quantised before anything else, so sender and receiver
+// hold the same reference.
+uint16_t sensor_encode(sensor_enc *enc, const linkaddr_t *peer,
+                       const sensor_sample *s, sensor_compact_packet *pkt)
+{
+    sensor_sample q = *s;
+    uint32_t batt = (s->battery + SENSOR_COMPACT_BATT_STEP / 2) / SENSOR_COMPACT_BATT_STEP;
+    q.battery = (batt > 0xFF ? 0xFF : batt) * SENSOR_COMPACT_BATT_STEP;
+
+    if (!linkaddr_cmp(&enc->peer, peer)) {
+        linkaddr_copy(&enc->peer, peer);
+        enc->has_ref = 0;
+    }
+    // an occupancy change is always decodable on its own
+    int full = !enc->has_ref || enc->pending > 0 ||
+               enc->since_full >= SENSOR_COMPACT_FULL_EVERY ||
+               (q.flags & SENSOR_FLAG_OCC_EVENT);
+    int32_t d[4] = {
+        (int32_t)q.light_lux - enc->ref.light_lux,
+        (int32_t)q.distance - enc->ref.distance,
+        ((int32_t)q.battery - enc->ref.battery) / SENSOR_COMPACT_BATT_STEP,
+        (int32_t)q.temperature - enc->ref.temperature,
+    };
+    for (int i = 0; i < 4 && !full; i++) {
+        full = !fits_i8(d[i]);
+    }
+
+    uint8_t *f = pkt->field;
+    pkt->type = PKT_HDR(SENSOR_COMPACT_PACKET);
+    pkt->seq = q.seq;
+    if (full) {
+        pkt->base = 0;
+        pkt->present = SENSOR_COMPACT_FULL | FIELD_BITS;
+        f = put16(f, q.light_lux);
+        f = put16(f, q.distance);
+        *f++ = q.battery / SENSOR_COMPACT_BATT_STEP;
+        *f++ = (uint8_t)q.temperature;
+        *f++ = q.flags;
+        enc->since_full = 0;
+        stats.full++;
+    } else {
+        pkt->base = enc->ref.seq;
+        pkt->present = 0;
+        // bits 0..3 are the four delta fields, in order
+        for (int i = 0; i < 4; i++) {
+            if (d[i] != 0) {
+                pkt->present |= 1 << i;
+                *f++ = (uint8_t)(int8_t)d[i];
+            }
+        }
+        if (q.flags != enc->ref.flags) {
+            pkt->present |= SENSOR_COMPACT_FLAGS;
+            *f++ = q.flags;
+        }
+        enc->since_full++;
+        stats.delta++;
+    }
+    enc->sent = q;
+    enc->pending++;
+    return f - (uint8_t *)pkt;
+}
+
+// Only the newest frame sent can become the reference; a failure of any
+// frame forces a full one, we can not tell what the peer holds.
+void sensor_encode_done(sensor_enc *enc, uint8_t seq, int acked)
+{
+    if (enc->pending > 0) {
+        enc->pending--;
+    }
+    if (!acked) {
+        enc->has_ref = 0;
+    } else if (seq == enc->sent.seq) {
+        enc->ref = enc->sent;
+        enc->has_ref = 1;
+    }
+}
+
+int sensor_decode(sensor_dec *dec, const void *data, uint16_t len,
+                  sensor_sample *out)
+{
+    const sensor_compact_packet *pkt = (const sensor_compact_packet *)data;
+    const uint8_t *f = pkt->field;
+    sensor_sample s;
+
+    if (pkt->present & SENSOR_COMPACT_FULL) {
+        if (pkt->present != (SENSOR_COMPACT_FULL | FIELD_BITS) ||
+            len != sizeof(sensor_compact_packet)) {
+            stats.bad++;
+            return -1;
+        }
+        memset(&s, 0, sizeof(s));
+        s.light_lux = get16(f);
+        s.distance = get16(f + 2);
+        s.battery = f[4] * SENSOR_COMPACT_BATT_STEP;
+        s.temperature = (int8_t)f[5];
+        s.flags = f[6];
+    } else {
+        uint16_t want = SENSOR_COMPACT_HDR_LEN;
+        for (int i = 0; i < 8; i++) {
+            want += (pkt->present >> i) & 1;
+        }
+        if ((pkt->present & ~FIELD_BITS) || len != want) {
+            stats.bad++;
+            return -1;
+        }
+        // MAC retransmission of the frame we just decoded
+        if (dec->has_ref && dec->ref.seq == pkt->seq) {
+            *out = dec->ref;
+            return 0;
+        }
+        if (!dec->has_ref || dec->ref.seq != pkt->base) {
+            stats.bad++;
+            return -1;
+        }
+        s = dec->ref;
+        if (pkt->present & SENSOR_COMPACT_LIGHT) {
+            s.light_lux += (int8_t)*f++;
+        }
+        if (pkt->present & SENSOR_COMPACT_DISTANCE) {
+            s.distance += (int8_t)*f++;
+        }
+        if (pkt->present & SENSOR_COMPACT_BATTERY) {
+            s.battery += (int8_t)*f++ * SENSOR_COMPACT_BATT_STEP;
+        }
+        if (pkt->present & SENSOR_COMPACT_TEMP) {
+            s.temperature += (int8_t)*f++;
+        }
+        if (pkt->present & SENSOR_COMPACT_FLAGS) {
+            s.flags = *f++;
+        }
+    }
+    s.seq = pkt->seq;
+    dec->ref = s;
+    dec->has_ref = 1;
+    *out = s;
+    return 0;
+}
+
+void sensor_codec_print_stats(void)
+{
+    printf("Compact samples full %u delta %u bad %u\n", stats.full, stats.delta, stats.bad);
+}
@@ -0,0 +1,120 @@
+/**
+ * @file    sensor_filter.c
+ * @brief   constant time streaming filters for sensor samples
+ */
+
+#include "sensor_filter.h"
+#include <string.h>
+
+// samples are kept in 16 bits, anything outside saturates
+static int16_t sat16(int32_t v)
+{
+    return v < INT16_MIN ? INT16_MIN : (v > INT16_MAX ? INT16_MAX : v);
+}
+
+// division rounding to nearest, also for negative values
+static int32_t div_round(int32_t num, int32_t den)
+{
+    return (num >= 0 ? num + den / 2 : num - den / 2) / den;
+}
+
+void filter_avg_init(filter_avg *f, uint8_t len)
+{
+    memset(f, 0, sizeof(*f));
+    f->len = len == 0 ? 1 : (len > FILTER_AVG_MAX ? FILTER_AVG_MAX : len);
+}
+
+// The sample leaving the window is taken off the sum, nothing is re-added.
+int16_t filter_avg_add(filter_avg *f, int32_t sample)
+{
+    int16_t s = sat16(sample);
+    if (f->cnt == f->len) {
+        f->sum -= f->buf[f->pos];
+    } else {
+        f->cnt++;
+    }
+    f->buf[f->pos] = s;
+    f->sum += s;
+    f->pos = (f->pos + 1) % f->len;
+    return filter_avg_value(f);
+}
+
+int16_t filter_avg_value(const filter_avg *f)
+{
+    return f->cnt == 0 ? 0 : div_round(f->sum, f->cnt);
+}
+
+void filter_ewma_init(filter_ewma *f, uint8_t shift)
+{
+    memset(f, 0, sizeof(*f));
+    f->shift = shift;
+}
+
+// The first sample is taken as it is instead of pulling up from 0.
+int16_t filter_ewma_add(filter_ewma *f, int32_t sample)
+{
+    int32_t s = (int32_t)sat16(sample) * (1 << FILTER_EWMA_FRAC);
+    if (!f->primed) {
+        f->value = s;
+        f->primed = 1;
+    } else {
+        f->value += div_round(s - f->value, 1 << f->shift);
+    }
+    return filter_ewma_value(f);
+}
+
+int16_t filter_ewma_value(const filter_ewma *f)
+{
+    return div_round(f->value, 1 << FILTER_EWMA_FRAC);
+}
+
+void filter_median_init(filter_median *f, uint8_t len)
+{
+    memset(f, 0, sizeof(*f));
+    f->len = len == 0 ? 1 : (len > FILTER_MEDIAN_MAX ? FILTER_MEDIAN_MAX : len);
+}
+
+// Sorts a copy of at most FILTER_MEDIAN_MAX samples, a single outlier
+// never reaches the output.
+int16_t filter_median_add(filter_median *f, int32_t sample)
+{
+    int16_t sorted[FILTER_MEDIAN_MAX];
+    f->buf[f->pos] = sat16(sample);
+    f->pos = (f->pos + 1) % f->len;
+    if (f->cnt < f->len) {
+        f->cnt++;
+    }
+    for (int i = 0; i < f->cnt; i++) {
+        int16_t v = f->buf[i];
+        int j = i;
+        while (j > 0 && sorted[j - 1] > v) {
+            sorted[j] = sorted[j - 1];
+            j--;
+        }
+        sorted[j] = v;
+    }
+    return sorted[f->cnt / 2];
+}
+
+void filter_hyst_init(filter_hyst *f, int16_t low, int16_t high)
+{
+    f->low = low;
+    f->high = high;
+    f->state = 0;
+    f->primed = 0;
+}
+
+// Values between the two thresholds keep the previous state, the first
+// one decides by the midpoint.
+uint8_t filter_hyst_update(filter_hyst *f, int32_t value)
+{
+    if (!f->primed) {
+        f->state = value >= ((int32_t)f->low + f->high) / 2;
+        f->primed = 1;
+    } else if (value >= f->high) {
+        f->state = 1;
+    } else if (value <= f->low) {
+        f->state = 0;
+    }
+    return f->state;
+}
@@ -0,0 +1,69 @@
+/**
+ * @file    sensor_filter.h
+ * @brief   constant time streaming filters for sensor samples
+ * @details one sample per call, the cost does not grow with the window:
+ *          moving average over a ring buffer with a running sum, EWMA,
+ *          median of the last few samples for spiky sensors, and a
+ *          hysteresis threshold that turns a value into a two-state flag
+***/
+
+#ifndef SENSOR_FILTER_H
+#define SENSOR_FILTER_H
+
+#include "contiki.h"
+
+#define FILTER_AVG_MAX      8   // longest moving average window
+#define FILTER_MEDIAN_MAX   5   // longest median window, keep it odd
+#define FILTER_EWMA_FRAC    4   // EWMA state keeps 4 fractional bits
+
+// mean of the last len samples, fewer until the window has filled
+typedef struct filter_avg
+{
+    int32_t sum;
+    uint8_t len;
+    uint8_t cnt;
+    uint8_t pos;
+    int16_t buf[FILTER_AVG_MAX];
+}filter_avg;
+
+// new = old + (sample - old) / 2^shift
+typedef struct filter_ewma
+{
+    int32_t value;          // times 2^FILTER_EWMA_FRAC
+    uint8_t shift;
+    uint8_t primed;
+}filter_ewma;
+
+// median of the last len samples
+typedef struct filter_median
+{
+    uint8_t len;
+    uint8_t cnt;
+    uint8_t pos;
+    int16_t buf[FILTER_MEDIAN_MAX];
+}filter_median;
+
+// state goes to 1 at or above high, back to 0 at or below low
+typedef struct filter_hyst
+{
+    int16_t low;
+    int16_t high;
+    uint8_t state;
+    uint8_t primed;
+}filter_hyst;
+
+void filter_avg_init(filter_avg *f, uint8_t len);
+int16_t filter_avg_add(filter_avg *f, int32_t sample);
+int16_t filter_avg_value(const filter_avg *f);
+
+void filter_ewma_init(filter_ewma *f, uint8_t shift);
+int16_t filter_ewma_add(filter_ewma *f, int32_t sample);
+int16_t filter_ewma_value(const filter_ewma *f);
+
+void filter_median_init(filter_median *f, uint8_t len);
+int16_t filter_median_add(filter_median *f, int32_t sample);
+
+void filter_hyst_init(filter_hyst *f, int16_t low, int16_t high);
+uint8_t filter_hyst_update(filter_hyst *f, int32_t value);
+
+#endif
@@ -10,8 +10,10 @@
 #include "net/linkaddr.h"
 #include "sys/node-id.h"
 #include "sys/log.h"
+#include "sys/ctimer.h"
 #include "lib/list.h"
 #include "lib/memb.h"
+#include "lib/random.h"
 #include "net/linkaddr.h"
 #include <string.h>
 #include <stdio.h>
@@ -21,6 +23,12 @@
 #include "common/temperature-sensor.h"
 #include "my_sensor.h"
 #include "my_functions.h"
+#include "link_estimator.h"
+#include "tx_queue.h"
+#include "rx_dispatch.h"
+#include "sensor_codec.h"
+#include "state_store.h"
+#include "sensor_filter.h"
 #include "packet_structure.h"
 #include "project-conf.h"
 
@@ -28,7 +36,6 @@
 static uint16_t last_seq_id = 0;
 static linkaddr_t addr_master;
 volatile static uint8_t net_is_stable;
-static uint8_t hello_forward_time;
 
 static short adjacency_matrix[MAX_NODES][MAX_NODES];  
 static  linkaddr_t node_index_to_addr[MAX_NODES] = {
@@ -45,12 +52,26 @@ static volatile uint8_t net_rejoin = 0;
 static int num_known_nodes = MAX_NODES;
 
 // sensor data transmission
-static uint8_t trans_flag = 1;
-static int distance_buffer[BUFFER_SIZE], light_buffer[BUFFER_SIZE], temperature_buffer[BUFFER_SIZE];
-static int global_index;
-static int distance_av_0, light_av_0, temperature_av_0;
-static int distance_av_1, light_av_1, temperature_av_1;
-static sensor_data recv_message;
+// occupancy as decided on the node: the confirmed state, the one seen in
+// the latest samples and since when; OCC_UNKNOWN until the first decision
+#define OCC_UNKNOWN 0xFF
+static uint8_t occ_stable = OCC_UNKNOWN;
+static uint8_t occ_candidate = OCC_UNKNOWN;
+static clock_time_t occ_since;
+static clock_time_t occ_last_report;
+// diagnostic mode, switched by the master: every sample goes up raw
+static uint8_t report_raw;
+// time between samples, moves between the two bounds with the activity
+// in the bay; the bounds can be set per bay by the master
+static clock_time_t sample_period_min = SENSOR_PERIOD_MIN;
+static clock_time_t sample_period_max = SENSOR_PERIOD_MAX;
+static clock_time_t sample_period = SENSOR_PERIOD_MIN;
+static clock_time_t sample_period_since;
+// smoothing, see sensor_filters_init()
+static filter_median distance_median;
+static filter_avg distance_avg, light_avg;
+static filter_ewma temperature_ewma;
+static filter_hyst light_hyst, distance_hyst;
 static float battery[MAX_NODES] ={1};
 
 LIST(local_rt_table);
@@ -59,36 +80,173 @@ MEMB(rt_mem,rt_entry,MAX_NODES);
 LIST(permanent_rt_table);
 MEMB(permanent_rt_mem,rt_entry,MAX_NODES);
 
+// flooding: remembers the (source, type, seq, fragment) of recent floods,
+// counts the copies overheard and holds the copy that is forwarded once the
+// jitter expires.
+typedef struct flood_entry{
+  uint8_t in_use;
+  linkaddr_t src;
+  uint8_t type;
+  uint16_t seq_id;
+  uint8_t frag;
+  uint8_t heard;
+  clock_time_t stamp;
+  struct ctimer fwd_timer;
+  uint8_t len;
+  uint8_t buf[sizeof(cluster_map_packet)];
+}flood_entry;
+static flood_entry flood_cache[FLOOD_CACHE_SIZE];
+static uint8_t flood_cache_next;
+
+// cluster advertisement: version of the assignment we hold (0 = none) and
+// the newest version seen passing through towards other nodes
+static uint16_t topology_version;
+static uint16_t seen_version;
+static struct ctimer refresh_timer;
+
+// failover: second way up from the master, and unacknowledged upstream
+// frames to the current parent. parent_generation tags frames so results
+// for a parent we already left are ignored.
+static linkaddr_t backup_parent;
+static uint8_t backup_hop;
+static uint8_t has_backup;
+static uint8_t parent_fail_cnt;
+static uint8_t parent_generation;
+
+// sinks heard from; the one with the fewest hops is addr_master
+typedef struct
+{
+  linkaddr_t addr;
+  uint8_t in_use;
+  uint8_t hops;
+  uint16_t seq_id;
+}sink_entry;
+static sink_entry sinks[MAX_SINKS];
+
+// warm restart: the parent we run with, as last written to flash, and
+// whether a restored one has acknowledged anything yet
+typedef struct
+{
+  uint16_t magic;
+  uint16_t version;
+  linkaddr_t master;
+  linkaddr_t parent;
+  linkaddr_t backup;
+  uint8_t has_backup;
+  uint8_t tot_hop;
+  uint8_t backup_hop;
+  int16_t metric;
+}saved_state;
+static saved_state stored_state;
+static uint8_t state_unverified;
+
 // heart beat
 static volatile uint8_t Node_death;
 // static uint8_t heart_record[MAX_NODES];
+// members heard from during the current heartbeat epoch, and how many
+// member heartbeats came in. Member data sets the bits too, but reaches
+// the master by itself and does not force a heartbeat of ours.
+static uint8_t heartbeat_alive[SCOPE_BYTES];
+static uint8_t heartbeat_members;
+static heartbeat_packet my_heart;
+// last acknowledged upstream frame, and how long we may stay silent
+static clock_time_t last_upstream_tx;
+static clock_time_t liveness_interval = HEARTBEAT_EPOCH;
+// samples waiting for the end of the aggregation window, nodes in our own
+// numbering until they are sent
+static sensor_agg_packet agg_pkt;
+static struct ctimer agg_timer;
+// samples that found no route, oldest first from store_head, nodes in our
+// own numbering
+typedef struct stored_sample
+{
+  sensor_sample sample;
+  clock_time_t taken;
+}stored_sample;
+static stored_sample store[SENSOR_STORE_MAX];
+static uint8_t store_head, store_cnt;
+// compact samples: ours towards the next hop, the members' towards us
+static sensor_enc own_enc;
+static sensor_dec member_dec[MAX_NODES];
 //static linkaddr_t addr_ch;
 //static uint8_t is_ch;
 
 
-//sensor data 
-void distance_av_cal(){
-	distance_av_1 = distance_av_0;
-	for(int i=0; i<BUFFER_SIZE; i++){
-		distance_av_0 += distance_buffer[i];
-	}
-	distance_av_0 /= BUFFER_SIZE;
+void sensor_filters_init()
+{
+  filter_median_init(&distance_median, DISTANCE_MEDIAN_LEN);
+  filter_avg_init(&distance_avg, BUFFER_SIZE);
+  filter_avg_init(&light_avg, BUFFER_SIZE);
+  filter_ewma_init(&temperature_ewma, TEMPERATURE_EWMA_SHIFT);
+  filter_hyst_init(&light_hyst, OCC_LIGHT_TH - OCC_LIGHT_HYST, OCC_LIGHT_TH + OCC_LIGHT_HYST);
+  filter_hyst_init(&distance_hyst, OCC_DISTANCE_TH - OCC_DISTANCE_HYST, OCC_DISTANCE_TH + OCC_DISTANCE_HYST);
 }
 
-void light_av_cal(){
-	light_av_1 = light_av_0;
-	for(int i=0; i<BUFFER_SIZE; i++){
-		light_av_0 += light_buffer[i];
-	}
-	light_av_0 /= BUFFER_SIZE;
+// A single raw sample this far from the averages means something arrived
+// or left; no baseline yet means no jump.
+int fast_change(int light, int distance)
+{
+  if(light <= 0 || distance <= 0 || filter_avg_value(&light_avg) == 0)
+  {
+    return 0;
+  }
+  return abs(light - filter_avg_value(&light_avg)) >= FAST_LIGHT_DELTA ||
+         abs(distance - filter_avg_value(&distance_avg)) >= FAST_DISTANCE_DELTA;
 }
 
-void temperture_av_cal(){
-	temperature_av_1 = temperature_av_0;
-	for(int i=0; i<BUFFER_SIZE; i++){
-		temperature_av_0 += temperature_buffer[i];
-	}
-	temperature_av_0 /= BUFFER_SIZE;
+// Cheap check between slow samples: one distance conversion against the
+// average, no other sensor and no filter is touched. A jump brings the
+// full sample forward, which then starts the fast path.
+int probe_changed()
+{
+  int distance = get_distance(saadc_sensor.value(P0_31));
+  int base = filter_avg_value(&distance_avg);
+  return base > 0 && distance > 0 && abs(distance - base) >= FAST_DISTANCE_DELTA;
+}
+
+// Bay is taken while it is dark and something is close, each with its
+// own hysteresis band. A new state is only confirmed once it held for
+// confirm ticks; returns 1 then.
+int occupancy_update(int light, int distance, clock_time_t confirm)
+{
+  if(light <= 0 || distance <= 0)
+  {
+    return 0;
+  }
+  uint8_t dark = !filter_hyst_update(&light_hyst, light);
+  uint8_t near = !filter_hyst_update(&distance_hyst, distance);
+  uint8_t occupied = dark && near;
+  if(occupied != occ_candidate)
+  {
+    occ_candidate = occupied;
+    occ_since = clock_time();
+  }
+  if(occ_candidate != occ_stable && clock_time() - occ_since >= confirm)
+  {
+    occ_stable = occ_candidate;
+    return 1;
+  }
+  return 0;
+}
+
+// Back to the fastest rate on activity, while a change waits for its
+// confirmation or with a value close to a threshold. Otherwise the period
+// doubles after every SENSOR_QUIET_TIME, up to the slowest rate.
+void sample_period_update(int activity, int light, int distance)
+{
+  int near = abs(light - OCC_LIGHT_TH) <= SENSOR_NEAR_LIGHT ||
+             abs(distance - OCC_DISTANCE_TH) <= SENSOR_NEAR_DISTANCE;
+  if(activity || near || occ_candidate != occ_stable)
+  {
+    sample_period = sample_period_min;
+    sample_period_since = clock_time();
+  }
+  else if(sample_period < sample_period_max && clock_time() - sample_period_since >= SENSOR_QUIET_TIME)
+  {
+    sample_period = sample_period * 2 < sample_period_max ? sample_period * 2 : sample_period_max;
+    sample_period_since = clock_time();
+    LOG_INFO("Sample period %lu s\n", (unsigned long)(sample_period / CLOCK_SECOND));
+  }
 }
 
 // routing discovery part 
@@ -181,11 +339,62 @@ void print_local_routing_table() {
   LOG_INFO("+------------------+ ----------------------+--------------------+\n");
 }
 
-void forward_hello(struct dio_packet *pkt)
+flood_entry *flood_cache_lookup(const linkaddr_t *src, uint8_t type, uint16_t seq_id, uint8_t frag)
+{
+  for(int i = 0; i < FLOOD_CACHE_SIZE; i++) {
+    if(flood_cache[i].in_use && flood_cache[i].seq_id == seq_id
+       && flood_cache[i].type == type && flood_cache[i].frag == frag
+       && linkaddr_cmp(&flood_cache[i].src, src)
+       && clock_time() - flood_cache[i].stamp < FLOOD_CACHE_LIFETIME) {
+      return &flood_cache[i];
+    }
+  }
+  return NULL;
+}
+
+void flood_cache_clear()
+{
+  for(int i = 0; i < FLOOD_CACHE_SIZE; i++) {
+    ctimer_stop(&flood_cache[i].fwd_timer);
+    flood_cache[i].in_use = 0;
+  }
+  flood_cache_next = 0;
+}
+
+static void flood_forward_callback(void *ptr)
+{
+  flood_entry *e = (flood_entry *)ptr;
+  // enough neighbours already rebroadcast this flood, ours adds nothing
+  if(e->heard >= FLOOD_SUPPRESS_K) {
+    LOG_INFO("Flood type %u forward suppressed, %u copies heard\n", e->type, e->heard);
+    return;
+  }
+  tx_queue_send(NULL, e->buf, e->len, TXQ_CLASS_CONTROL, NULL, NULL);
+}
+
+// Remember the first copy of a flood and forward it after a random delay.
+// The oldest entry is overwritten when the cache is full.
+void flood_schedule_forward(const linkaddr_t *src, uint16_t seq_id, uint8_t frag,
+                            const void *data, uint16_t len)
 {
-  nullnet_buf = (uint8_t *)pkt;
-  nullnet_len = sizeof(*pkt);
-  NETSTACK_NETWORK.output(NULL);
+  if(len > sizeof(flood_cache[0].buf))
+  {
+    return;
+  }
+  flood_entry *e = &flood_cache[flood_cache_next];
+  flood_cache_next = (flood_cache_next + 1) % FLOOD_CACHE_SIZE;
+  ctimer_stop(&e->fwd_timer);
+  e->in_use = 1;
+  linkaddr_copy(&e->src, src);
+  e->type = PKT_HDR_TYPE(*(const uint8_t *)data);
+  e->seq_id = seq_id;
+  e->frag = frag;
+  e->heard = 1;
+  e->stamp = clock_time();
+  e->len = len;
+  memcpy(e->buf, data, len);
+  ctimer_set(&e->fwd_timer, random_rand() % (FLOOD_JITTER_MAX + 1),
+             flood_forward_callback, e);
 }
 
 void insert_entry_to_rt_table(const linkaddr_t *dst, const linkaddr_t *next_hop,uint8_t tot_hop, int16_t metric,uint16_t seq_no)
@@ -261,15 +470,521 @@ bool parent_is_in_rt_table(const linkaddr_t *src)
   return 0;
 }
 
+// A sink numbers the network with itself at index 0: swap 0 and the
+// sink's own index. The same call converts in both directions.
+int sink_index(int index, const linkaddr_t *sink)
+{
+  int k = get_index_from_addr(sink);
+  if(k <= 0 || index < 0 || index >= MAX_NODES)
+  {
+    return index;
+  }
+  if(index == 0)
+  {
+    return k;
+  }
+  return index == k ? 0 : index;
+}
+
+// our own index as the given sink knows it
+int my_sink_index(const linkaddr_t *sink)
+{
+  return sink_index(get_index_from_addr(&linkaddr_node_addr), sink);
+}
+
+// wrap-safe: a version is stale if it is not newer than the one we hold
+int version_is_stale(uint16_t version)
+{
+  return topology_version != 0 && (int16_t)(version - topology_version) <= 0;
+}
+
+// Upstream goes to the assigned cluster parent once we have one,
+// before that to whoever brought us the HELLO.
+const linkaddr_t *get_upstream_hop()
+{
+  const linkaddr_t *next = get_next_hop_to(&addr_master, 1);
+  if(next == NULL)
+  {
+    next = get_next_hop_to(&addr_master, 0);
+  }
+  return next;
+}
+
+// Ask the master to re-send the advertisement of node, which holds version.
+// With a parent, node has failed over to it and the master moves it there.
+static void request_refresh(const linkaddr_t *node, uint16_t version, const linkaddr_t *parent)
+{
+  static refresh_packet pkt;
+  const linkaddr_t *next = get_upstream_hop();
+  if(next == NULL)
+  {
+    LOG_WARN("No route to master for refresh request\n");
+    return;
+  }
+  pkt.type = PKT_HDR(REFRESH_PACKET);
+  linkaddr_copy(&pkt.src, node);
+  pkt.version = version;
+  linkaddr_copy(&pkt.parent, parent != NULL ? parent : &linkaddr_null);
+  tx_queue_send(next, &pkt, sizeof(pkt), TXQ_CLASS_CONTROL, NULL, NULL);
+}
+
+static void send_refresh_request(void *ptr)
+{
+  // our own advertisement arrived in the meantime
+  if(topology_version != 0 && (int16_t)(seen_version - topology_version) <= 0)
+  {
+    return;
+  }
+  LOG_INFO("Missed topology version %u (hold %u), requesting refresh\n",
+           seen_version, topology_version);
+  request_refresh(&linkaddr_node_addr, topology_version, NULL);
+}
+
+// Pop our hop off a source route and return the next one, NULL if the
+// packet carries no route or the route does not pass through us.
+const linkaddr_t *source_route_next(source_route *route, const linkaddr_t *sink)
+{
+  int my_index = my_sink_index(sink);
+  if(route->len == 0 || route->pos + 1 >= route->len || route->len > SOURCE_ROUTE_MAX_HOPS)
+  {
+    return NULL;
+  }
+  if(route->hop[route->pos] != my_index)
+  {
+    LOG_WARN("Source route hop %u is not me\n", route->hop[route->pos]);
+    return NULL;
+  }
+  route->pos++;
+  if(route->hop[route->pos] >= MAX_NODES)
+  {
+    return NULL;
+  }
+  return &node_index_to_addr[sink_index(route->hop[route->pos], sink)];
+}
+
+// A newer version is on its way to other nodes, ours should follow shortly;
+// ask the master if it does not.
+void note_newer_version(uint16_t version)
+{
+  if(seen_version == 0 || (int16_t)(version - seen_version) > 0)
+  {
+    seen_version = version;
+    if(topology_version == 0 || (int16_t)(seen_version - topology_version) > 0)
+    {
+      ctimer_set(&refresh_timer, ADVERT_REFRESH_DELAY, send_refresh_request, NULL);
+    }
+  }
+}
+
+// Write the current parent to flash if it differs from what is there.
+void save_state()
+{
+#if PERSIST_STATE
+  saved_state st;
+  rt_entry *e = list_head(permanent_rt_table);
+  if(e == NULL)
+  {
+    return;
+  }
+  memset(&st, 0, sizeof(st));
+  st.magic = STATE_MAGIC;
+  st.version = topology_version;
+  linkaddr_copy(&st.master, &addr_master);
+  linkaddr_copy(&st.parent, &e->next_hop);
+  linkaddr_copy(&st.backup, has_backup ? &backup_parent : &linkaddr_null);
+  st.has_backup = has_backup;
+  st.tot_hop = e->tot_hop;
+  st.backup_hop = backup_hop;
+  st.metric = e->metric;
+  if(memcmp(&st, &stored_state, sizeof(st)) == 0)
+  {
+    return;
+  }
+  if(state_store_write(&st, sizeof(st)) == 0)
+  {
+    stored_state = st;
+  }
+#endif
+}
+
+// The cached parent never answered: drop it and join like a new node.
+void forget_state()
+{
+  LOG_WARN("Cached parent unreachable, rejoining\n");
+#if PERSIST_STATE
+  state_store_erase();
+#endif
+  memset(&stored_state, 0, sizeof(stored_state));
+  state_unverified = 0;
+  memb_init(&permanent_rt_mem);
+  list_init(permanent_rt_table);
+  linkaddr_copy(&addr_master, &linkaddr_null);
+  topology_version = 0;
+  seen_version = 0;
+  net_is_stable = 0;
+}
+
+// Take over the parent from an advertisement or the cluster map,
+// unless we already hold this or a newer version.
+void install_parent(const linkaddr_t *parent, const linkaddr_t *backup,
+                    uint16_t tot_hop, uint8_t backup_tot_hop, int16_t metric, uint16_t version)
+{
+  if(version_is_stale(version))
+  {
+    LOG_INFO("Stale advertisement v%u, holding v%u\n", version, topology_version);
+    return;
+  }
+  if(topology_version != 0 && version != topology_version + 1)
+  {
+    LOG_INFO("Topology version jumped %u -> %u\n", topology_version, version);
+  }
+  topology_version = version;
+  if((int16_t)(seen_version - topology_version) < 0)
+  {
+    seen_version = topology_version;
+  }
+  has_backup = backup != NULL && !linkaddr_cmp(backup, &linkaddr_null);
+  if(has_backup)
+  {
+    linkaddr_copy(&backup_parent, backup);
+    backup_hop = backup_tot_hop;
+  }
+  parent_fail_cnt = 0;
+  parent_generation++;
+  memb_init(&permanent_rt_mem);
+  list_init(permanent_rt_table);
+  rt_entry *e = memb_alloc(&permanent_rt_mem);
+  if(e != NULL) {
+    linkaddr_copy(&(e->dest), &addr_master);
+    linkaddr_copy(&(e->next_hop), parent);
+    e->tot_hop = tot_hop;
+    e->metric = metric;
+    e->seq_no = 1;
+    list_add(permanent_rt_table, e);
+    uint16_t dest_id = get_node_id_from_linkaddr(&(e->dest));
+    uint16_t next_id = get_node_id_from_linkaddr(&(e->next_hop));
+    LOG_INFO("+------------------+ Permanent Routing Table: +--------------------+\n");
+    LOG_INFO("|No.0 | dest:%u | next:%u | backup:%u | tot_hop:%u | rssi:%d | version:%u |\n",
+           dest_id, next_id,
+           has_backup ? get_node_id_from_linkaddr(&backup_parent) : NO_PARENT,
+           e->tot_hop, e->metric, topology_version);
+    LOG_INFO("+------------------+ ------------------------ +--------------------+\n");
+  }
+  save_state();
+}
+
+// Primary parent stopped acknowledging: switch to the backup right away
+// instead of waiting for the master to notice, then tell the master so
+// its source routes stop going through the old parent.
+void parent_failover()
+{
+  rt_entry *e = list_head(permanent_rt_table);
+  if(e == NULL || !has_backup)
+  {
+    LOG_WARN("Parent unreachable, no backup parent\n");
+    if(state_unverified)
+    {
+      forget_state();
+    }
+    return;
+  }
+  LOG_WARN("Parent %u unreachable, failing over to backup %u\n",
+           get_node_id_from_linkaddr(&e->next_hop),
+           get_node_id_from_linkaddr(&backup_parent));
+  linkaddr_copy(&e->next_hop, &backup_parent);
+  e->tot_hop = backup_hop;
+  has_backup = 0;
+  parent_fail_cnt = 0;
+  parent_generation++;
+  save_state();
+  request_refresh(&linkaddr_node_addr, topology_version, &e->next_hop);
+}
+
+// Stable link: stay silent longer. Missed ACK: back to one epoch.
+void liveness_adapt(int acked)
+{
+  if(acked)
+  {
+    last_upstream_tx = clock_time();
+    liveness_interval = MIN(liveness_interval + HEARTBEAT_EPOCH, HEARTBEAT_MAX_IDLE);
+  }
+  else
+  {
+    liveness_interval = HEARTBEAT_EPOCH;
+  }
+}
+
+static void upstream_sent_callback(void *ptr, int status, int transmissions)
+{
+  if((uint8_t)(uintptr_t)ptr != parent_generation)
+  {
+    return;
+  }
+  const linkaddr_t *parent = get_upstream_hop();
+  if(parent != NULL)
+  {
+    link_est_tx(parent, status, transmissions);
+  }
+  liveness_adapt(status == MAC_TX_OK);
+  if(status == MAC_TX_OK)
+  {
+    parent_fail_cnt = 0;
+    if(state_unverified)
+    {
+      LOG_INFO("Cached parent confirmed\n");
+      state_unverified = 0;
+    }
+  }
+  else if(status == MAC_TX_NOACK && ++parent_fail_cnt >= PARENT_FAIL_THRESHOLD)
+  {
+    parent_failover();
+  }
+}
+
+// Frames to the parent go through the queue with the MAC result hooked up,
+// it is what watches the parent. The generation tag drops results for a
+// parent we already left.
+int send_upstream(const linkaddr_t *next, const void *data, uint16_t len)
+{
+  return tx_queue_send(next, data, len, TXQ_CLASS_DATA,
+                       upstream_sent_callback, (void *)(uintptr_t)parent_generation);
+}
+
+// A heartbeat the parent did not acknowledge: the members it carried go
+// into the next one.
+static void heartbeat_sent_callback(void *ptr, int status, int transmissions)
+{
+  if(status != MAC_TX_OK)
+  {
+    for(int i = 0; i < SCOPE_BYTES; i++)
+    {
+      heartbeat_alive[i] |= my_heart.alive[i];
+    }
+    heartbeat_members++;
+  }
+  upstream_sent_callback(ptr, status, transmissions);
+}
+
+// A member's frame we relay as received, watched like send_upstream().
+int forward_upstream(const linkaddr_t *next)
+{
+  return tx_queue_forward(next, TXQ_CLASS_DATA,
+                          upstream_sent_callback, (void *)(uintptr_t)parent_generation);
+}
+
+// Keep a sample until a route is back, the oldest one goes when full. It
+// no longer proves its node alive when it is finally sent.
+static void store_add(const sensor_sample *sample)
+{
+  if(store_cnt == SENSOR_STORE_MAX)
+  {
+    LOG_WARN("Sample store full, oldest sample of %u dropped\n", store[store_head].sample.node);
+    store_head = (store_head + 1) % SENSOR_STORE_MAX;
+    store_cnt--;
+  }
+  stored_sample *st = &store[(store_head + store_cnt) % SENSOR_STORE_MAX];
+  st->sample = *sample;
+  st->sample.flags = (sample->flags & ~SENSOR_FLAG_ALIVE) | SENSOR_FLAG_STORED;
+  st->taken = clock_time() - sample->age * CLOCK_SECOND;
+  store_cnt++;
+}
+
+// Samples in flight keep a copy here until the MAC result, a frame the
+// next hop does not acknowledge puts them into the store. One more than
+// the data class of the TX queue holds, so this never runs out first.
+typedef struct inflight
+{
+  uint8_t generation;
+  uint8_t seq;                          // encoder seq of a compact frame
+  uint8_t cnt;
+  sensor_sample sample[SENSOR_AGG_MAX]; // in our numbering
+}inflight;
+MEMB(inflight_mem, inflight, TXQ_LIMIT_DATA + 1);
+
+static void sample_sent_callback(void *ptr, int status, int transmissions)
+{
+  inflight *f = (inflight *)ptr;
+  uint8_t generation = f->generation;
+  if(status != MAC_TX_OK)
+  {
+    LOG_WARN("%u samples not acknowledged, stored\n", f->cnt);
+    for(int i = 0; i < f->cnt; i++)
+    {
+      store_add(&f->sample[i]);
+    }
+  }
+  memb_free(&inflight_mem, f);
+  upstream_sent_callback((void *)(uintptr_t)generation, status, transmissions);
+}
+
+// MAC result of a compact sample: the encoder's reference moves on only
+// once the next hop has it.
+static void compact_sent_callback(void *ptr, int status, int transmissions)
+{
+  sensor_encode_done(&own_enc, ((inflight *)ptr)->seq, status == MAC_TX_OK);
+  sample_sent_callback(ptr, status, transmissions);
+}
+
+static inflight *inflight_new(const sensor_sample *sample, uint8_t cnt)
+{
+  inflight *f = memb_alloc(&inflight_mem);
+  if(f != NULL)
+  {
+    f->generation = parent_generation;
+    f->cnt = cnt;
+    memcpy(f->sample, sample, cnt * sizeof(sensor_sample));
+  }
+  return f;
+}
+
+// A frame of cnt samples, given here in our numbering. Returns -1 like a
+// full queue, the caller keeps the samples.
+static int send_samples(const linkaddr_t *next, const void *data, uint16_t len,
+                        const sensor_sample *sample, uint8_t cnt)
+{
+  inflight *f = inflight_new(sample, cnt);
+  if(f == NULL)
+  {
+    return -1;
+  }
+  int ret = tx_queue_send(next, data, len, TXQ_CLASS_DATA, sample_sent_callback, f);
+  if(ret < 0)
+  {
+    memb_free(&inflight_mem, f);
+  }
+  return ret;
+}
+
+// Our own sample to the next hop, encoded against what it acknowledged.
+int send_compact(const linkaddr_t *next, const sensor_sample *sample)
+{
+  sensor_compact_packet pkt;
+  inflight *f = inflight_new(sample, 1);
+  if(f == NULL)
+  {
+    return -1;
+  }
+  uint16_t len = sensor_encode(&own_enc, next, sample, &pkt);
+  f->seq = pkt.seq;
+  int ret = tx_queue_send(next, &pkt, len, TXQ_CLASS_DATA, compact_sent_callback, f);
+  if(ret < 0)
+  {
+    sensor_encode_done(&own_enc, pkt.seq, 0);
+    memb_free(&inflight_mem, f);
+  }
+  return ret;
+}
+
+// Stored samples go up oldest first, SENSOR_AGG_MAX per frame, with their
+// age. Whatever the TX queue does not take stays for the next call.
+static void store_drain()
+{
+  static sensor_agg_packet pkt;
+  static sensor_sample keep[SENSOR_AGG_MAX];
+  const linkaddr_t *next = get_upstream_hop();
+  while(store_cnt > 0 && next != NULL)
+  {
+    pkt.cnt = 0;
+    while(pkt.cnt < store_cnt && pkt.cnt < SENSOR_AGG_MAX)
+    {
+      const stored_sample *st = &store[(store_head + pkt.cnt) % SENSOR_STORE_MAX];
+      clock_time_t age = (clock_time() - st->taken) / CLOCK_SECOND;
+      keep[pkt.cnt] = st->sample;
+      keep[pkt.cnt].age = age > 0xFF ? 0xFF : age;
+      sensor_sample *s = &pkt.sample[pkt.cnt];
+      *s = keep[pkt.cnt++];
+      s->node = sink_index(s->node, &addr_master);
+    }
+    pkt.type = PKT_HDR(SENSOR_AGG_PACKET);
+    linkaddr_copy(&pkt.src, &linkaddr_node_addr);
+    if(send_samples(next, &pkt, SENSOR_AGG_HDR_LEN + pkt.cnt * sizeof(sensor_sample), keep, pkt.cnt) < 0)
+    {
+      return;
+    }
+    LOG_INFO("Sent %u stored samples\n", pkt.cnt);
+    store_head = (store_head + pkt.cnt) % SENSOR_STORE_MAX;
+    store_cnt -= pkt.cnt;
+  }
+}
+
+// End of the aggregation window: everything collected goes up as one
+// frame, indexed in the numbering of the sink it goes to.
+static void agg_flush(void *ptr)
+{
+  ctimer_stop(&agg_timer);
+  if(agg_pkt.cnt == 0)
+  {
+    return;
+  }
+  const linkaddr_t *next = get_upstream_hop();
+  if(next == NULL)
+  {
+    LOG_WARN("No route to master, %u aggregated samples stored\n", agg_pkt.cnt);
+    for(int i = 0; i < agg_pkt.cnt; i++)
+    {
+      store_add(&agg_pkt.sample[i]);
+    }
+    agg_pkt.cnt = 0;
+    return;
+  }
+  store_drain();
+  // translated into a copy, the window stays in our numbering in case it
+  // has to be stored
+  static sensor_agg_packet out;
+  out.cnt = agg_pkt.cnt;
+  for(int i = 0; i < agg_pkt.cnt; i++)
+  {
+    out.sample[i] = agg_pkt.sample[i];
+    out.sample[i].node = sink_index(agg_pkt.sample[i].node, &addr_master);
+  }
+  out.type = PKT_HDR(SENSOR_AGG_PACKET);
+  linkaddr_copy(&out.src, &linkaddr_node_addr);
+  if(send_samples(next, &out, SENSOR_AGG_HDR_LEN + out.cnt * sizeof(sensor_sample),
+                  agg_pkt.sample, agg_pkt.cnt) < 0)
+  {
+    LOG_WARN("TX queue full, %u aggregated samples stored\n", agg_pkt.cnt);
+    for(int i = 0; i < agg_pkt.cnt; i++)
+    {
+      store_add(&agg_pkt.sample[i]);
+    }
+  }
+  agg_pkt.cnt = 0;
+}
+
+// A newer sample of a node replaces the one held, stored ones are all
+// kept. The window opens with the first sample, a full buffer goes out
+// early.
+static void agg_add(uint8_t node, const sensor_sample *sample)
+{
+  int i = 0;
+  while(i < agg_pkt.cnt && (agg_pkt.sample[i].node != node ||
+        ((agg_pkt.sample[i].flags | sample->flags) & SENSOR_FLAG_STORED)))
+  {
+    i++;
+  }
+  if(i == SENSOR_AGG_MAX)
+  {
+    agg_flush(NULL);
+    i = 0;
+  }
+  agg_pkt.sample[i] = *sample;
+  agg_pkt.sample[i].node = node;
+  if(i == agg_pkt.cnt && agg_pkt.cnt++ == 0)
+  {
+    ctimer_set(&agg_timer, SENSOR_AGG_WINDOW, agg_flush, NULL);
+  }
+}
+
 static void routing_report(const linkaddr_t *dest, uint8_t hop, int8_t rssi, uint16_t seq_id)
 {
   static struct rt_entry_pkt pkt;
   //memset(&pkt, 0, sizeof(pkt));
-  pkt.type = RT_REPORT_PACKET;
+  pkt.type = PKT_HDR(RT_REPORT_PACKET);
   linkaddr_copy(&pkt.src, &linkaddr_node_addr);
+  linkaddr_copy(&pkt.sink, &addr_master);
   pkt.hop_count = 0;
   pkt.seq_id = seq_id;
-  pkt.battery = get_millivolts(saadc_sensor.value(BATTERY_SENSOR));
+  pkt.battery = wire_u16(get_millivolts(saadc_sensor.value(BATTERY_SENSOR)));
   
   rt_entry *iter = list_head(local_rt_table);
   linkaddr_copy(&pkt.rt_src,     &iter->dest);
@@ -286,13 +1001,11 @@ static void routing_report(const linkaddr_t *dest, uint8_t hop, int8_t rssi, uin
     linkaddr_copy(&pkt.rt_dest,     &iter->dest);
     linkaddr_copy(&pkt.rt_next_hop, &iter->next_hop);
     pkt.rt_tot_hop = iter->tot_hop;
-    pkt.rt_metric  = iter->metric;
+    pkt.rt_metric  = wire_i8(iter->metric);
     pkt.rt_seq_no  = iter->seq_no;
 
     // clock_wait(CLOCK_SECOND / 20);  // wait 50 ms
-    nullnet_buf = (uint8_t *)&pkt;
-    nullnet_len = sizeof(pkt);
-    NETSTACK_NETWORK.output(dest); 
+    tx_queue_send(dest, &pkt, sizeof(pkt), TXQ_CLASS_ROUTING, NULL, NULL);
   }
   LOG_INFO("I have sent RT_REPORT_PACKET\n");
   uint16_t dest_id = get_node_id_from_linkaddr(dest);
@@ -301,29 +1014,147 @@ static void routing_report(const linkaddr_t *dest, uint8_t hop, int8_t rssi, uin
 
 
 
+// Smoothed RSSI of the link the current frame came in on.
+int8_t smoothed_rssi(const linkaddr_t *src)
+{
+  link_stats *link = link_est_lookup(src);
+  if(link == NULL)
+  {
+    return (int8_t)packetbuf_attr(PACKETBUF_ATTR_RSSI);
+  }
+  return link_est_rssi(link);
+}
+
 // Receive hello packet callback
 // 1.forward hello packet
 // 2.reply to the src node
 // 3,adding the hello packet info from the rt_table
-static void DIO_PACKET_callback(const void *data, uint16_t len,
-                           const linkaddr_t *src, const linkaddr_t *dest)
+// Follow the closest sink. Versions are counted per sink, so a switch
+// starts over and takes the first assignment the new sink sends.
+void choose_sink()
+{
+  sink_entry *best = NULL;
+  sink_entry *cur = NULL;
+  for(int i = 0; i < MAX_SINKS; i++)
+  {
+    if(!sinks[i].in_use)
+    {
+      continue;
+    }
+    if(linkaddr_cmp(&sinks[i].addr, &addr_master))
+    {
+      cur = &sinks[i];
+    }
+    if(best == NULL || sinks[i].hops < best->hops)
+    {
+      best = &sinks[i];
+    }
+  }
+  if(best == NULL || best == cur)
+  {
+    return;
+  }
+  if(cur != NULL && best->hops + SINK_SWITCH_HOPS > cur->hops)
+  {
+    return;
+  }
+  LOG_INFO("Following sink %u, %u hops\n", get_node_id_from_linkaddr(&best->addr), best->hops);
+  linkaddr_copy(&addr_master, &best->addr);
+  topology_version = 0;
+  seen_version = 0;
+  ctimer_stop(&refresh_timer);
+}
+
+// Hop count of a sink from one of its HELLOs; the fewest over all copies
+// of a flood count.
+void note_sink(const linkaddr_t *addr, uint8_t hops, uint16_t seq_id)
 {
-  int8_t rssi = (int8_t)packetbuf_attr(PACKETBUF_ATTR_RSSI);
-  //LOG_INFO("Hello Packet Process begin\r\n");
-  if(rssi <= RSSSI_TH)
+  sink_entry *s = NULL;
+  for(int i = 0; i < MAX_SINKS && s == NULL; i++)
+  {
+    if(sinks[i].in_use && linkaddr_cmp(&sinks[i].addr, addr))
+    {
+      s = &sinks[i];
+    }
+  }
+  for(int i = 0; i < MAX_SINKS && s == NULL; i++)
   {
-    LOG_WARN("low RSSI DAO, rejected\n\r");
+    if(!sinks[i].in_use)
+    {
+      s = &sinks[i];
+      s->in_use = 1;
+      linkaddr_copy(&s->addr, addr);
+      s->seq_id = seq_id + 1;
+    }
+  }
+  if(s == NULL)
+  {
+    LOG_WARN("More than %u sinks\n", MAX_SINKS);
     return;
   }
+  if(s->seq_id != seq_id)
+  {
+    s->seq_id = seq_id;
+    s->hops = hops;
+  }
+  else
+  {
+    s->hops = MIN(s->hops, hops);
+  }
+  choose_sink();
+}
+
+// A scoped HELLO (local repair) is only answered by the nodes it names,
+// the others just pass it on. Without a known index we answer anyway.
+int hello_in_scope(const struct dio_packet *pkt)
+{
+  int me = my_sink_index(&pkt->src_master);
+  if(me < 0 || me >= MAX_NODES)
+  {
+    return 1;
+  }
+  return (pkt->scope[me / 8] >> (me % 8)) & 1;
+}
+
+static void DIO_PACKET_callback(const void *data, uint16_t len,
+                           const linkaddr_t *src, const linkaddr_t *dest)
+{
+  int8_t rssi = smoothed_rssi(src);
   // processing the hello packet info
-  leds_single_on(LEDS_LED2);
   struct dio_packet *pkt = (struct dio_packet *)data;
   linkaddr_t report_src;
-  linkaddr_copy(&addr_master, &pkt->src_master);
+  // a unicast HELLO is a join offer for us alone, see NEWNODE_PACKET_callback
+  int is_offer = !linkaddr_cmp(dest, &linkaddr_null);
+  // the flood goes on regardless, but a neighbour we heard only once or
+  // twice is not reported to the master as a link yet
+  int adjacent = is_offer || link_est_adjacent(src);
+  // hops from the sink to us, forwarded copies carry ours
+  pkt->hop_count++;
+  note_sink(&pkt->src_master, pkt->hop_count, pkt->seq_id);
   linkaddr_copy(&report_src, &pkt->src);
-  
-  
-  if(pkt->seq_id <=1)
+  // every copy still tells us about a neighbour, but only the first one
+  // of a flood may reset the tables or be forwarded
+  flood_entry *seen = flood_cache_lookup(&pkt->src_master, HELLO_PACKET, pkt->seq_id, 0);
+  if(seen != NULL)
+  {
+    seen->heard++;
+  }
+  // other sinks only count for choosing one (note_sink above), their
+  // floods are passed on but never touch our tables or reports
+  if(!hello_in_scope(pkt) || !linkaddr_cmp(&pkt->src_master, &addr_master))
+  {
+    if(seen == NULL && !is_offer)
+    {
+      linkaddr_copy(&pkt->src, &linkaddr_node_addr);
+      flood_schedule_forward(&pkt->src_master, pkt->seq_id, 0, pkt, sizeof(*pkt));
+    }
+    return;
+  }
+  net_is_stable  = 0;
+  printf("State is not stable\n\n");
+
+  // a new discovery of the sink we follow
+  if(pkt->seq_id <=1 && seen == NULL && !is_offer)
   {
     for (int i = 0; i < MAX_NODES; i++) {
       for (int j = 0; j < MAX_NODES; j++) {
@@ -335,6 +1166,11 @@ static void DIO_PACKET_callback(const void *data, uint16_t len,
     insert_entry_to_rt_table(&linkaddr_node_addr, &linkaddr_node_addr, 0, 0, 0);
     memb_init(&permanent_rt_mem);
     list_init(permanent_rt_table);
+    flood_cache_clear();
+    // a new discovery, the master may have restarted its versions too
+    topology_version = 0;
+    seen_version = 0;
+    ctimer_stop(&refresh_timer);
     last_seq_id = pkt->seq_id;
   }
   // Avoid loops: if already seen, drop
@@ -346,238 +1182,434 @@ static void DIO_PACKET_callback(const void *data, uint16_t len,
   last_seq_id = pkt->seq_id;
   // processing the packet info
   
-  //pkt->hop_count++;
   linkaddr_copy(&pkt->src, &linkaddr_node_addr);
 
   // update_local_rt_table(master_node info + hello packet info);
   // flooding connectivity
 
-  // adding the hello pkt_src to the routing table
-  patch_update_local_rt_table(&report_src,&report_src,1,rssi,pkt->seq_id);
-
-  // other nodes adding the master node hop to the routing table
-  if (!linkaddr_cmp(&report_src, &pkt->src_master))
+  if(adjacent)
   {
-    patch_update_local_rt_table(&pkt->src_master,&report_src,pkt->hop_count,rssi,pkt->seq_id);
+    // adding the hello pkt_src to the routing table
+    patch_update_local_rt_table(&report_src,&report_src,1,rssi,pkt->seq_id);
+
+    // other nodes adding the master node hop to the routing table
+    if (!linkaddr_cmp(&report_src, &pkt->src_master))
+    {
+      patch_update_local_rt_table(&pkt->src_master,&report_src,pkt->hop_count,rssi,pkt->seq_id);
+    }
   }
   // print the local_rt_table
   LOG_INFO("Local routing tabel is listed as follw: \r\n");
   //print_local_routing_table();
   
   // Forward the packet
-
-  if(hello_forward_time < 3){
-    forward_hello(pkt);
-    hello_forward_time ++;
+  if(seen == NULL && !is_offer){
+    flood_schedule_forward(&pkt->src_master, pkt->seq_id, 0, pkt, sizeof(*pkt));
   }
   
   // Reply the true source
-  routing_report(&report_src, pkt->hop_count, rssi,pkt->seq_id);
-  leds_single_off(LEDS_LED2);
+  if(adjacent)
+  {
+    routing_report(&report_src, pkt->hop_count, rssi,pkt->seq_id);
+  }
 }
 
 static void DAO_PACKET_callback(const void *data, uint16_t len,
                            const linkaddr_t *src, const linkaddr_t *dest)
 {
-  leds_single_on(LEDS_LED2);
   LOG_INFO("Receiving RT_REPORT_PACEKT:\n");
   struct rt_entry_pkt *pkt = (struct rt_entry_pkt *)data;
-  pkt->hop_count++;
-  int8_t rssi = (int8_t)packetbuf_attr(PACKETBUF_ATTR_RSSI);
-  // avoid unstalbe link hard decision
-  if(rssi <= RSSSI_TH)
+  if(!linkaddr_cmp(&pkt->sink, &addr_master))
   {
-    LOG_WARN("low RSSI DAO, rejected\n\r");
+    LOG_INFO("RT_REPORT for another sink, dropped\n");
     return;
   }
-  patch_update_local_rt_table(src,src,pkt->hop_count,rssi,pkt->seq_id);
-  routing_report(&addr_master, pkt->hop_count, rssi,pkt->seq_id);
+  int8_t rssi = smoothed_rssi(src);
+  // rewrite in place and pass it on first, our own report below reuses
+  // the packetbuf; forwarding may send right away, so nothing pointing
+  // into the packetbuf is used after it
+  pkt->hop_count++;
+  uint8_t hop = pkt->hop_count;
+  uint16_t seq_id = pkt->seq_id;
+  linkaddr_t sender;
+  linkaddr_copy(&sender, src);
   LOG_INFO("Not the Master Node forwarding RT_REPORT_PACKET:\n");
   const linkaddr_t *next = get_next_hop_to(&addr_master,0);
-  nullnet_buf = (uint8_t *)pkt;
-  nullnet_len = sizeof(*pkt);
-  NETSTACK_NETWORK.output(next); 
+  // a NULL next hop would go out as a broadcast
+  if(next == NULL)
+  {
+    LOG_WARN("No route to master, RT_REPORT of %u dropped\n", get_node_id_from_linkaddr(&sender));
+  }
+  else
+  {
+    tx_queue_forward(next, TXQ_CLASS_ROUTING, NULL, NULL);
+  }
+  patch_update_local_rt_table(&sender,&sender,hop,rssi,seq_id);
+  routing_report(&addr_master, hop, rssi,seq_id);
 }
 
 static void SENSOR_PACKET_callback(const void *data, uint16_t len, 
                             const linkaddr_t *src, const linkaddr_t *dest){
-  int8_t rssi = (int8_t)packetbuf_attr(PACKETBUF_ATTR_RSSI);
-  //LOG_INFO("Hello Packet Process begin\r\n");
-  if(rssi <= RSSSI_TH)
-  {
-    LOG_WARN("low RSSI DAO, rejected\n\r");
-    return;
-  }                    
-	memcpy(&recv_message, (sensor_data*)data, sizeof(recv_message));
-	if(recv_message.type == 3){
-    uint16_t src = get_node_id_from_linkaddr(&recv_message.source);
-		//LOG_INFO("Received data are from %d:\n\r", src);
-		//LOG_INFO("batttery: [%d](mV)\n\r", recv_message.battery);
-		//LOG_INFO("temperature: [%d](C)\n\r", recv_message.temperature);
-		//LOG_INFO("light: [%d](lux)\n\r", recv_message.light_lux);
-		//LOG_INFO("distance: [%d](cm)\n\r", recv_message.distance);
-    battery[src] = (float)(recv_message.battery/3700);
-
-    printf("Received data are from %d:\n\r", get_node_id_from_linkaddr(&recv_message.source));
-		printf("batttery: [%d](mV):\n\r", recv_message.battery);
-		printf("temperature: [%d](C):\n\r", recv_message.temperature);
-		//printf("Node: %i SensorType: 1 Value: %d \n\r", src,recv_message.light_lux);
-	  //printf("Node: %i SensorType: 2 Value: %d \n\r", src, recv_message.distance);
-    printf("Node: %d SensorType: 1 Value: %d Battery: %d \n\r",
-            src, recv_message.light_lux, recv_message.battery*100/3800);
-    printf("Node: %d SensorType: 2 Value: %d Battery: %d \n\r",
-            src, recv_message.distance, recv_message.battery*100/3800);
-      
+  // read in place, the frame goes up unchanged
+  const sensor_data *msg = (const sensor_data *)data;
+  uint16_t src_id = get_node_id_from_linkaddr(&msg->source);
+  if(src_id >= MAX_NODES)
+  {
+    LOG_WARN("Can't find the src id\n\r");
+    return;
+  }
+  // a member's sample sent to us stands in for its heartbeat
+  if((msg->flags & SENSOR_FLAG_ALIVE) && linkaddr_cmp(dest, &linkaddr_node_addr)){
+    int bit = sink_index(src_id, &addr_master);
+    heartbeat_alive[bit / 8] |= 1 << (bit % 8);
+  }
+  battery[src_id] = (float)(msg->battery/3700);
+
+  printf("Received data are from %d:\n\r", src_id);
+  printf("batttery: [%d](mV):\n\r", msg->battery);
+  printf("temperature: [%d](C):\n\r", msg->temperature);
+  printf("Node: %d SensorType: 1 Value: %d Battery: %d \n\r",
+          src_id, msg->light_lux, msg->battery*100/3800);
+  printf("Node: %d SensorType: 2 Value: %d Battery: %d \n\r",
+          src_id, msg->distance, msg->battery*100/3800);
+  if(!linkaddr_cmp(dest, &linkaddr_node_addr)){
+    return;
+  }
+  // relay towards the master, merged with the other members' samples
+  if(SENSOR_AGG_WINDOW > 0){
+    sensor_sample sample;
+    sensor_sample_from(&sample, src_id, msg);
+    agg_add(src_id, &sample);
+    return;
+  }
+  const linkaddr_t *next = get_upstream_hop();
+  if(next != NULL){
+    forward_upstream(next);
+  }
+}
 
-	}
+// A member's own sample, only decodable by the hop it was meant for.
+static void SENSOR_COMPACT_PACKET_callback(const void *data, uint16_t len,
+                            const linkaddr_t *src, const linkaddr_t *dest)
+{
+  if(!linkaddr_cmp(dest, &linkaddr_node_addr)){
+    return;
+  }
+  uint16_t src_id = get_node_id_from_linkaddr(src);
+  if(src_id >= MAX_NODES)
+  {
+    LOG_WARN("Can't find the src id\n\r");
+    return;
+  }
+  sensor_sample sample;
+  if(sensor_decode(&member_dec[src_id], data, len, &sample) < 0)
+  {
+    LOG_WARN("Compact sample from %u not decodable\n", src_id);
+    return;
+  }
+  if(sample.flags & SENSOR_FLAG_ALIVE){
+    int bit = sink_index(src_id, &addr_master);
+    heartbeat_alive[bit / 8] |= 1 << (bit % 8);
+  }
+  if(SENSOR_AGG_WINDOW > 0){
+    agg_add(src_id, &sample);
+    return;
+  }
+  // the encoding does not go past one hop, relay it as a plain sample
+  const linkaddr_t *next = get_upstream_hop();
+  if(next != NULL){
+    sensor_data msg = {
+      .type = PKT_HDR(SENSOR_DATA_PACKET),
+      .light_lux = sample.light_lux,
+      .distance = sample.distance,
+      .battery = sample.battery,
+      .temperature = sample.temperature,
+      .flags = sample.flags,
+      .seq = sample.seq,
+    };
+    linkaddr_copy(&msg.source, src);
+    sample.node = src_id;
+    if(send_samples(next, &msg, sizeof(msg), &sample, 1) < 0)
+    {
+      store_add(&sample);
+    }
+  }
 }
- 
 
-static void ADVERTISE_PACKET_callback(const void *data, uint16_t len, 
-                            const linkaddr_t *src, const linkaddr_t *dest) {
-  if(len != sizeof(struct advertise_packet)) {
+// A member's own aggregate: its samples join the ones we collect.
+static void SENSOR_AGG_PACKET_callback(const void *data, uint16_t len,
+                            const linkaddr_t *src, const linkaddr_t *dest)
+{
+  const sensor_agg_packet *pkt = (const sensor_agg_packet *)data;
+  if(pkt->cnt > SENSOR_AGG_MAX || len != SENSOR_AGG_HDR_LEN + pkt->cnt * sizeof(sensor_sample)) {
     LOG_WARN("Wrong packet size: %u\n", len);
     return;
   }
+  if(!linkaddr_cmp(dest, &linkaddr_node_addr)){
+    return;
+  }
+  if(SENSOR_AGG_WINDOW == 0){
+    const linkaddr_t *next = get_upstream_hop();
+    if(next != NULL){
+      forward_upstream(next);
+    }
+    return;
+  }
+  // copied out first: a full buffer flushes from agg_add(), and sending
+  // reuses the packetbuf the frame sits in
+  sensor_sample sample[SENSOR_AGG_MAX];
+  uint8_t cnt = pkt->cnt;
+  memcpy(sample, pkt->sample, cnt * sizeof(sensor_sample));
+  for(int i = 0; i < cnt; i++){
+    // indexed for the sink we share with the member
+    uint8_t bit = sample[i].node;
+    if(bit >= MAX_NODES){
+      continue;
+    }
+    if(sample[i].flags & SENSOR_FLAG_ALIVE){
+      heartbeat_alive[bit / 8] |= 1 << (bit % 8);
+    }
+    agg_add(sink_index(bit, &addr_master), &sample[i]);
+  }
+}
+ 
 
+static void ADVERTISE_PACKET_callback(const void *data, uint16_t len, 
+                            const linkaddr_t *src, const linkaddr_t *dest) {
+  printf("State is stable\n\n");
+  net_is_stable = 1;
   struct advertise_packet *pkt = (struct advertise_packet *)data;
-  int8_t rssi = (int8_t)packetbuf_attr(PACKETBUF_ATTR_RSSI);
+  int8_t rssi = smoothed_rssi(src);
   LOG_INFO("Geting ADVERTISE packet:\n");
   LOG_INFO("  Dest node:       %u\n", get_node_id_from_linkaddr(&(pkt->dest)));
   LOG_INFO("  CH node:    %u\n", get_node_id_from_linkaddr(&(pkt->advertise_ch)));
-  LOG_INFO("  Seq ID:          %u\n", pkt->seq_id);
-  //LOG_INFO("Hello Packet Process begin\r\n");
-  if(rssi <= RSSSI_TH )
-  {
-    LOG_WARN("low RSSI DAO, rejected\n\r");
-    return;
-  }
+  LOG_INFO("  Version:         %u\n", pkt->version);
   if(linkaddr_cmp(&(pkt->dest), &linkaddr_node_addr)) {
     // my dest 
-    //linkaddr_cmp(&master_addr,&pkt->advertise_ch);
-    memb_init(&permanent_rt_mem);
-    list_init(permanent_rt_table);
-    rt_entry *e = memb_alloc(&permanent_rt_mem);
-    if(e != NULL) {
-      linkaddr_copy(&(e->dest), &addr_master);
-      linkaddr_copy(&(e->next_hop), &(pkt->advertise_ch));
-      e->tot_hop = pkt->tot_hop;
-      e->metric = rssi;
-      e->seq_no = 1;
-      list_add(permanent_rt_table, e);
-      uint16_t dest_id = get_node_id_from_linkaddr(&(e->dest));
-      uint16_t next_id = get_node_id_from_linkaddr(&(e->next_hop));
-      LOG_INFO("+------------------+ Permanent Routing Table: +--------------------+\n");
-      LOG_INFO("|No.0 | dest:%u | next:%u | tot_hop:%u | rssi:%d | tot_hop:%d |seq:%u |\n",
-             dest_id, next_id,
-             e->tot_hop, e->metric, e->tot_hop, e->seq_no);
-      LOG_INFO("+------------------+ ------------------------ +--------------------+\n");
-
+    if(!linkaddr_cmp(&pkt->src_master, &addr_master))
+    {
+      LOG_INFO("Advertisement from a sink we do not follow\n");
+      return;
     }
-
+    install_parent(&pkt->advertise_ch, &pkt->backup_ch, pkt->tot_hop, pkt->backup_hop, rssi, pkt->version);
+    store_drain();
   } else {
     // not my dest
-    nullnet_buf = (uint8_t *)pkt;
-    nullnet_len = sizeof(struct advertise_packet);
-    NETSTACK_NETWORK.output((get_next_hop_to(&(pkt->dest),0)));
+    if(linkaddr_cmp(&pkt->src_master, &addr_master))
+    {
+      note_newer_version(pkt->version);
+    }
+    // the master's hop list is current even while our table is not
+    const linkaddr_t *next = source_route_next(&pkt->route, &pkt->src_master);
+    if(next == NULL && pkt->route.len == 0)
+    {
+      next = get_next_hop_to(&(pkt->dest),0);
+    }
+    if(next == NULL)
+    {
+      LOG_WARN("No route to advertise dest\n");
+      return;
+    }
+    // route position was advanced in place
+    tx_queue_forward(next, TXQ_CLASS_CONTROL, NULL, NULL);
   }
 }
 
 
+// Flooded parent array: take our own entry and pass the fragment on.
+static void CLUSTER_MAP_PACKET_callback(const void *data, uint16_t len,
+                            const linkaddr_t *src, const linkaddr_t *dest)
+{
+  const cluster_map_packet *pkt = (const cluster_map_packet *)data;
+  if(pkt->cnt > CLUSTER_MAP_FRAG_ENTRIES
+     || len != CLUSTER_MAP_HDR_LEN + pkt->cnt * sizeof(cluster_map_entry)) {
+    LOG_WARN("Wrong packet size: %u\n", len);
+    return;
+  }
+  int8_t rssi = smoothed_rssi(src);
+  flood_entry *seen = flood_cache_lookup(&pkt->src_master, CLUSTER_MAP_PACKET, pkt->version, pkt->frag);
+  if(seen != NULL)
+  {
+    seen->heard++;
+    return;
+  }
+  int ours = linkaddr_cmp(&pkt->src_master, &addr_master);
+  // older than what we hold, nobody downstream needs it either
+  if(ours && topology_version != 0 && (int16_t)(pkt->version - topology_version) < 0)
+  {
+    return;
+  }
+  flood_schedule_forward(&pkt->src_master, pkt->version, pkt->frag, pkt, len);
+  if(!ours)
+  {
+    return;
+  }
+
+  int my_index = my_sink_index(&pkt->src_master);
+  if(my_index < pkt->first || my_index >= pkt->first + pkt->cnt)
+  {
+    // our entry travels in another fragment
+    note_newer_version(pkt->version);
+    return;
+  }
+  const cluster_map_entry *entry = &pkt->entry[my_index - pkt->first];
+  if(entry->parent >= MAX_NODES)
+  {
+    LOG_WARN("Not assigned in cluster map v%u\n", pkt->version);
+    return;
+  }
+  install_parent(&node_index_to_addr[sink_index(entry->parent, &pkt->src_master)],
+                 entry->backup < MAX_NODES ? &node_index_to_addr[sink_index(entry->backup, &pkt->src_master)] : NULL,
+                 entry->tot_hop, entry->backup_hop, rssi, pkt->version);
+  net_is_stable = 1;
+}
+
 static void HEARTBEAT_PACKET_callback(const void *data, uint16_t len, 
                             const linkaddr_t *src, const linkaddr_t *dest){
   heartbeat_packet* pkt = (heartbeat_packet*)data;
-  int8_t rssi = (int8_t)packetbuf_attr(PACKETBUF_ATTR_RSSI);
-  linkaddr_t des = pkt->des;
-  patch_update_local_rt_table(&pkt->src, &pkt->src, 1, rssi, 0);
-  if(linkaddr_cmp(&des, &linkaddr_node_addr)){
-    linkaddr_copy(&pkt->des, get_next_hop_to(&addr_master, 0));;
-    nullnet_buf = (uint8_t *)pkt;
-    nullnet_len = sizeof(*pkt);
-    NETSTACK_NETWORK.output(NULL);
-    routing_report(&pkt->des, 2, rssi, 10);
+  // heartbeats are unicast to the parent, only members get here
+  if(linkaddr_cmp(dest, &linkaddr_node_addr)){
+    link_est_rx_seq(src, pkt->seq);
+    int8_t rssi = smoothed_rssi(src);
+    patch_update_local_rt_table(&pkt->src, &pkt->src, 1, rssi, 0);
+    // merged into our own summary at the end of the epoch
+    for(int i = 0; i < SCOPE_BYTES; i++){
+      heartbeat_alive[i] |= pkt->alive[i];
+    }
+    heartbeat_members++;
+    // a member never hears the floods and adverts it missed, its heartbeat
+    // is where we notice; the master re-sends its entry
+    uint16_t newest = (int16_t)(seen_version - topology_version) > 0 ? seen_version : topology_version;
+    if(newest != 0 && (int16_t)(pkt->version - newest) < 0){
+      LOG_INFO("Member %u holds version %u of %u, requesting refresh\n",
+               get_node_id_from_linkaddr(&pkt->src), pkt->version, newest);
+      request_refresh(&pkt->src, pkt->version, NULL);
+    }
   }
 }
 
 
 static int board_cast_rejoion = 0;
-static uint8_t received_6_flag;
+static linkaddr_t offer_to;
+static clock_time_t offer_time;
 
+// A node that missed discovery asks for neighbours. Once we are attached
+// we answer with a unicast HELLO; it reports its links through us and the
+// master places it without touching anyone else.
 void NEWNODE_PACKET_callback(const void *data, uint16_t len,
                             const linkaddr_t *src, const linkaddr_t *dest)
 {
   const newnode_packet *pkt = (const newnode_packet *)data;
-
-  // Only process packets with the correct type
-  
-    if(linkaddr_cmp(&addr_master,NULL))
-    {
-      if(!board_cast_rejoion)
-      {
-        nullnet_buf = (uint8_t *)pkt;
-        nullnet_len = sizeof(*pkt);
-        NETSTACK_NETWORK.output(NULL);
-        board_cast_rejoion = 1;
-      }
-    }
-    else{
-      nullnet_buf = (uint8_t *)pkt;
-      nullnet_len = sizeof(*pkt);
-      NETSTACK_NETWORK.output(get_next_hop_to(&addr_master, 0));
-    }
+  static struct dio_packet offer;
+  rt_entry *e = list_head(permanent_rt_table);
+  if(e == NULL || linkaddr_cmp(&addr_master, &linkaddr_null))
+  {
+    return;
+  }
+  if(linkaddr_cmp(&offer_to, &pkt->src) && clock_time() - offer_time < JOIN_OFFER_HOLDOFF)
+  {
+    return;
+  }
+  linkaddr_copy(&offer_to, &pkt->src);
+  offer_time = clock_time();
+  offer.type = PKT_HDR(HELLO_PACKET);
+  linkaddr_copy(&offer.src, &linkaddr_node_addr);
+  linkaddr_copy(&offer.src_master, &addr_master);
+  offer.hop_count = e->tot_hop;
+  offer.seq_id = last_seq_id;
+  memset(offer.scope, 0xFF, SCOPE_BYTES);
+  LOG_INFO("Join offer to node %u\n", get_node_id_from_linkaddr(&pkt->src));
+  tx_queue_send(&pkt->src, &offer, sizeof(offer), TXQ_CLASS_CONTROL, NULL, NULL);
 }
 
-static void HELLO_Callback(const void *data, uint16_t len,
-                           const linkaddr_t *src, const linkaddr_t *dest)
+// A worker asks the master to re-send its advertisement, relay it.
+static void REFRESH_PACKET_callback(const void *data, uint16_t len,
+                            const linkaddr_t *src, const linkaddr_t *dest)
 {
-  leds_single_on(LEDS_LED2);
-  uint8_t type = *((uint8_t *)data);
-  LOG_INFO("<< Received packet, type = %d, len = %d\n", type, len);
-  switch(type) {
-    case HELLO_PACKET:
-      net_is_stable  = 0;
-      printf("State is not stable\n\n");
-      DIO_PACKET_callback(data, len, src, dest);
-      leds_single_off(LEDS_LED2);
-      break;
-    case RT_REPORT_PACKET:
-      // net_is_stable  = 0;
-      printf("State is not stable\n\n");
-      DAO_PACKET_callback(data, len, src, dest);
-      leds_single_off(LEDS_LED2);
-      break;
-    case SENSOR_DATA_PACKET:
-      SENSOR_PACKET_callback(data, len, src, dest);
-      leds_single_off(LEDS_LED2);
-      break;
-    case ADVERTISE_PACKET:
-      printf("State is stable\n\n");
-      net_is_stable = 1;
-      ADVERTISE_PACKET_callback(data, len, src, dest);
-      leds_single_off(LEDS_LED2);
-      break;
-    case HEARTBEAT_PACKET:
-      HEARTBEAT_PACKET_callback(data, len, src, dest);
-      leds_single_off(LEDS_LED2);
-      break;
-    case NEWNODE_PACKET:
-      if(received_6_flag){
-        return;
-      }
-      net_is_stable  = 0;
-      printf("State is not stable\n\n");
-      NEWNODE_PACKET_callback(data, len, src, dest);
-      received_6_flag = 1;
-      leds_single_off(LEDS_LED2);
-      break;
+  const linkaddr_t *next = get_upstream_hop();
+  if(next != NULL)
+  {
+    tx_queue_forward(next, TXQ_CLASS_CONTROL, NULL, NULL);
+  }
+}
 
-    default:
-      LOG_WARN("Unknown packet type: %d\r\n", type);
+// The master switches the raw sample feed of the nodes in scope.
+static void SENSOR_MODE_PACKET_callback(const void *data, uint16_t len,
+                            const linkaddr_t *src, const linkaddr_t *dest)
+{
+  const sensor_mode_packet *pkt = (const sensor_mode_packet *)data;
+  flood_entry *seen = flood_cache_lookup(&pkt->src_master, SENSOR_MODE_PACKET, pkt->seq, 0);
+  if(seen != NULL)
+  {
+    seen->heard++;
+    return;
+  }
+  flood_schedule_forward(&pkt->src_master, pkt->seq, 0, pkt, len);
+  int me = my_sink_index(&pkt->src_master);
+  if(me < 0 || me >= MAX_NODES || !((pkt->scope[me / 8] >> (me % 8)) & 1))
+  {
+    return;
+  }
+  if(pkt->raw != SENSOR_MODE_KEEP)
+  {
+    report_raw = pkt->raw;
+    LOG_INFO("Raw sample feed %s\n", report_raw ? "on" : "off");
+  }
+  if(pkt->period_min > 0 && pkt->period_max >= pkt->period_min)
+  {
+    sample_period_min = pkt->period_min * CLOCK_SECOND;
+    sample_period_max = pkt->period_max * CLOCK_SECOND;
+    sample_period = sample_period_min;
+    sample_period_since = clock_time();
+    LOG_INFO("Sample period %u..%u s\n", pkt->period_min, pkt->period_max);
   }
 }
 
+// Lengths are checked here, handlers may cast data right away. Handlers
+// flagged RX_USABLE_LINK only see frames from links the estimator accepts.
+// The join exchange is judged on RSSI alone, a newcomer has no history:
+// NEWNODE broadcasts and HELLOs unicast to us (join offers).
+static const rx_handler_entry rx_handlers[] = {
+  { HELLO_PACKET,       RX_USABLE_LINK | RX_UNICAST_RSSI, sizeof(struct dio_packet), sizeof(struct dio_packet), DIO_PACKET_callback },
+  { RT_REPORT_PACKET,   RX_USABLE_LINK, sizeof(struct rt_entry_pkt), sizeof(struct rt_entry_pkt), DAO_PACKET_callback },
+  { SENSOR_DATA_PACKET, RX_USABLE_LINK, sizeof(sensor_data), sizeof(sensor_data), SENSOR_PACKET_callback },
+  { ADVERTISE_PACKET,   RX_USABLE_LINK, sizeof(struct advertise_packet), sizeof(struct advertise_packet), ADVERTISE_PACKET_callback },
+  { HEARTBEAT_PACKET,   0, sizeof(heartbeat_packet), sizeof(heartbeat_packet), HEARTBEAT_PACKET_callback },
+  { NEWNODE_PACKET,     RX_RSSI_ONLY, sizeof(newnode_packet), sizeof(newnode_packet), NEWNODE_PACKET_callback },
+  { REFRESH_PACKET,     0, sizeof(refresh_packet), sizeof(refresh_packet), REFRESH_PACKET_callback },
+  { CLUSTER_MAP_PACKET, RX_USABLE_LINK, CLUSTER_MAP_HDR_LEN, sizeof(cluster_map_packet), CLUSTER_MAP_PACKET_callback },
+  { SENSOR_AGG_PACKET,  RX_USABLE_LINK, SENSOR_AGG_HDR_LEN, sizeof(sensor_agg_packet), SENSOR_AGG_PACKET_callback },
+  { SENSOR_MODE_PACKET, RX_USABLE_LINK, sizeof(sensor_mode_packet), sizeof(sensor_mode_packet), SENSOR_MODE_PACKET_callback },
+  { SENSOR_COMPACT_PACKET, 0, SENSOR_COMPACT_HDR_LEN, sizeof(sensor_compact_packet), SENSOR_COMPACT_PACKET_callback },
+};
 
 
+
+// Resume with the parent from before the reboot. It is only trusted until
+// the first upstream frames go unacknowledged, see parent_failover().
+int restore_state()
+{
+#if PERSIST_STATE
+  saved_state st;
+  if(!state_store_read(&st, sizeof(st)))
+  {
+    return 0;
+  }
+  if(st.magic != STATE_MAGIC)
+  {
+    LOG_WARN("Ignoring invalid saved state\n");
+    return 0;
+  }
+  stored_state = st;
+  linkaddr_copy(&addr_master, &st.master);
+  install_parent(&st.parent, st.has_backup ? &st.backup : NULL, st.tot_hop, st.backup_hop, st.metric, st.version);
+  state_unverified = 1;
+  return 1;
+#else
+  return 0;
+#endif
+}
+
 process_event_t rejoin_event;
 static uint8_t hello_process_cnt = 0;
 
@@ -614,7 +1646,20 @@ PROCESS_THREAD(hello_process, ev, data) {
   insert_entry_to_rt_table(&linkaddr_node_addr, &linkaddr_node_addr, 0, 0, 0);
   memb_init(&permanent_rt_mem);
   list_init(permanent_rt_table);
-  nullnet_set_input_callback(HELLO_Callback);
+  memb_init(&inflight_mem);
+  link_est_init();
+  tx_queue_init();
+  rx_dispatch_init(rx_handlers, sizeof(rx_handlers) / sizeof(rx_handlers[0]));
+#if NET_STATS
+  rx_dispatch_print_budget();
+#endif
+  nullnet_set_input_callback(rx_dispatch_input);
+  if(restore_state())
+  {
+    // send the first sample right away instead of after discovery
+    net_is_stable = 1;
+    process_poll(&sensor_report_process);
+  }
 
   last_seq_id = 1;
   etimer_set(&timer, CLOCK_SECOND * 5);
@@ -633,11 +1678,9 @@ PROCESS_THREAD(hello_process, ev, data) {
       if(net_rejoin == 1) {
         printf("BROADCAST LALALALALA\n");
         static newnode_packet pkt;
-        pkt.type = NEWNODE_PACKET;
+        pkt.type = PKT_HDR(NEWNODE_PACKET);
         linkaddr_copy(&(pkt.src), &linkaddr_node_addr);
-        nullnet_buf = (uint8_t *)&pkt;
-        nullnet_len = sizeof(pkt);
-        NETSTACK_NETWORK.output(NULL);
+        tx_queue_send(NULL, &pkt, sizeof(pkt), TXQ_CLASS_CONTROL, NULL, NULL);
         hello_process_cnt = 0;
         net_rejoin = 0;
       }
@@ -650,15 +1693,31 @@ PROCESS_THREAD(hello_process, ev, data) {
 PROCESS_THREAD(sensor_report_process, ev, data)
 {
   static struct etimer sensor_reading_timer;
+  static struct etimer probe_timer;
 	static int light_raw, distance_raw;
 	static int light_value, distance_value;
+	static int light_av, distance_av, distance_med;
 	static int voltage, temperature;
 	static sensor_data packet;
+	static uint8_t burst_left;
   PROCESS_BEGIN();
-  etimer_set(&sensor_reading_timer, CLOCK_SECOND*3);
+  sensor_filters_init();
+  etimer_set(&sensor_reading_timer, sample_period);
+  etimer_set(&probe_timer, SENSOR_PROBE_INTERVAL);
 
     while(1) {
-      PROCESS_WAIT_EVENT();
+      PROCESS_WAIT_EVENT_UNTIL(ev == PROCESS_EVENT_POLL || etimer_expired(&sensor_reading_timer)
+                               || etimer_expired(&probe_timer));
+      if(etimer_expired(&probe_timer))
+      {
+        etimer_reset(&probe_timer);
+        // between samples only; at the fast rates the samples are the probe
+        if(ev != PROCESS_EVENT_POLL && !etimer_expired(&sensor_reading_timer)
+           && (sample_period <= SENSOR_PROBE_INTERVAL || burst_left > 0 || !probe_changed()))
+        {
+          continue;
+        }
+      }
           // read raw data from ADC
         light_raw = saadc_sensor.value(P0_30);
         distance_raw = saadc_sensor.value(P0_31);
@@ -669,47 +1728,78 @@ PROCESS_THREAD(sensor_report_process, ev, data)
         voltage = get_millivolts(saadc_sensor.value(BATTERY_SENSOR));
         temperature = temperature_sensor.value(0)/4;
 
-        distance_buffer[global_index] = distance_value;
-        light_buffer[global_index] = light_value;
-        temperature_buffer[global_index] = temperature;
-        global_index ++;
-        if(global_index>=BUFFER_SIZE){
-          distance_av_cal();
-          light_av_cal();
-          temperture_av_cal();
-          global_index = 0;
+        // a jump against the baseline starts a burst of quick samples, the
+        // decision then only needs FAST_CONFIRM_TIME instead of waiting
+        // for the window
+        if(burst_left == 0 && fast_change(light_value, distance_value))
+        {
+          burst_left = FAST_BURST_SAMPLES;
+          LOG_INFO("Fast path, light %d distance %d\n", light_value, distance_value);
         }
-        if(ABS(distance_av_1-distance_av_0) >= DIS_THRES || ABS(light_av_1-light_av_0) >= LIGHT_THRES){
-          trans_flag = 1;
+        // IR distance spikes are dropped by the median before averaging
+        distance_med = filter_median_add(&distance_median, distance_value);
+        distance_av = filter_avg_add(&distance_avg, distance_med);
+        light_av = filter_avg_add(&light_avg, light_value);
+        temperature = filter_ewma_add(&temperature_ewma, temperature);
+        // only occupancy changes and a rare summary go up, unless the
+        // master asked for the raw feed
+        int occ_event = occupancy_update(light_value, distance_med,
+                                         burst_left ? FAST_CONFIRM_TIME : OCC_CONFIRM_TIME);
+        sample_period_update(burst_left > 0 || occ_event, light_value, distance_med);
+        if(burst_left > 0)
+        {
+          burst_left = occ_event ? 0 : burst_left - 1;
         }
+        int keepalive = clock_time() - occ_last_report >= OCC_KEEPALIVE;
+        // a route may be back since the last sample
+        store_drain();
         // assign data to packet;
         net_is_stable = 1;
-        if(trans_flag && net_is_stable){
-          packet.type = 3;
+        if(((report_raw && burst_left == 0) || occ_event || keepalive) && net_is_stable){
+          packet.type = PKT_HDR(SENSOR_DATA_PACKET);
           linkaddr_copy(&packet.source, &linkaddr_node_addr);
-          packet.light_lux = light_av_0;
-          packet.distance = distance_av_0;
-          packet.battery = voltage;
-          packet.temperature = temperature;
-
-          // transmit data to master
-          const linkaddr_t *next_hop = get_next_hop_to(&addr_master, 0);
-          if(next_hop != NULL) {
-            nullnet_buf = (uint8_t *)&packet;
-            nullnet_len = sizeof(packet);
-            NETSTACK_NETWORK.output(next_hop);
+          packet.light_lux = wire_u16(report_raw ? light_value : light_av);
+          packet.distance = wire_u16(report_raw ? distance_value : distance_av);
+          packet.battery = wire_u16(voltage);
+          packet.temperature = wire_i8(temperature);
+          packet.flags = SENSOR_FLAG_ALIVE;
+          if(occ_stable != OCC_UNKNOWN) {
+            packet.flags |= SENSOR_FLAG_OCC_KNOWN | (occ_stable ? SENSOR_FLAG_OCCUPIED : 0);
+          }
+          if(occ_event) {
+            packet.flags |= SENSOR_FLAG_OCC_EVENT;
+            LOG_INFO("Bay %s\n", occ_stable ? "occupied" : "free");
+          }
+          packet.seq++;
+          occ_last_report = clock_time();
+
+          // transmit data to master, with the members' samples if a
+          // window is open anyway
+          uint16_t me = get_node_id_from_linkaddr(&linkaddr_node_addr);
+          const linkaddr_t *next_hop = get_upstream_hop();
+          if(agg_pkt.cnt > 0 && me < MAX_NODES) {
+            sensor_sample sample;
+            sensor_sample_from(&sample, me, &packet);
+            agg_add(me, &sample);
+          } else if(next_hop != NULL) {
+            sensor_sample sample;
+            sensor_sample_from(&sample, me, &packet);
+            if(send_compact(next_hop, &sample) < 0) {
+              store_add(&sample);
+              LOG_WARN("TX queue full, sample stored\n");
+            }
             LOG_INFO("Sent sensor data to master. Temp=%i, Distance=%i, Battery=%i, Light_Lux%i\n",
             packet.temperature,packet.distance,packet.battery,packet.light_lux);
+          } else if(me < MAX_NODES) {
+            sensor_sample sample;
+            sensor_sample_from(&sample, me, &packet);
+            store_add(&sample);
+            LOG_WARN("No route to master, sample stored\n");
           } else {
             LOG_WARN("No route to master!\n");
           }
-          trans_flag = 0;
         }
-        if(received_6_flag>0) received_6_flag++;
-        if(received_6_flag>4) received_6_flag = 0;
-        if(hello_forward_time >= 3) hello_forward_time ++;
-        if(hello_forward_time > 6) hello_forward_time = 0;
-      etimer_reset(&sensor_reading_timer);
+      etimer_set(&sensor_reading_timer, burst_left ? FAST_BURST_INTERVAL : sample_period);
     }
   PROCESS_END();
 }
@@ -738,20 +1828,47 @@ PROCESS_THREAD(sensor_report_process, ev, data)
 PROCESS_THREAD(heartbeat_pass_process, ev, data){
   PROCESS_BEGIN();
   static struct etimer et;
-  etimer_set(&et, CLOCK_SECOND*8);
-  heartbeat_packet my_heart;
+  etimer_set(&et, HEARTBEAT_EPOCH);
   while (1)
   {
     PROCESS_WAIT_EVENT_UNTIL(etimer_expired(&et));
-    printf("Ready to send heatbeat, %d", net_is_stable);
-    if(net_is_stable){
+    // nothing from members and our own traffic is recent enough
+    if(net_is_stable && heartbeat_members == 0
+       && clock_time() - last_upstream_tx < liveness_interval){
+      LOG_DBG("Heartbeat skipped, idle %lu of %lu ticks\n", (unsigned long)(clock_time() - last_upstream_tx),
+              (unsigned long)liveness_interval);
+    }
+    else if(net_is_stable && get_upstream_hop() == NULL){
+      LOG_DBG("Heartbeat skipped, no parent\n");
+    }
+    else if(net_is_stable){
+      int me = my_sink_index(&addr_master);
+      if(me >= 0 && me < MAX_NODES){
+        heartbeat_alive[me / 8] |= 1 << (me % 8);
+      }
       linkaddr_copy(&my_heart.src, &linkaddr_node_addr);
-      my_heart.type = HEARTBEAT_PACKET;
-      linkaddr_copy(&my_heart.des, get_next_hop_to(&addr_master,0));
-      nullnet_buf = (uint8_t *)&my_heart;
-      nullnet_len = sizeof(my_heart);
-      NETSTACK_NETWORK.output(NULL);
+      my_heart.type = PKT_HDR(HEARTBEAT_PACKET);
+      my_heart.seq++;
+      my_heart.version = topology_version;
+      linkaddr_copy(&my_heart.des, get_upstream_hop());
+      memcpy(my_heart.alive, heartbeat_alive, SCOPE_BYTES);
+      memset(heartbeat_alive, 0, SCOPE_BYTES);
+      heartbeat_members = 0;
+      // the parent's ACK is our liveness check on it, see upstream_sent_callback.
+      // Members go back in for the next epoch if the queue is full, or from
+      // heartbeat_sent_callback if the parent does not acknowledge.
+      if(tx_queue_send(&my_heart.des, &my_heart, sizeof(my_heart), TXQ_CLASS_DATA,
+                       heartbeat_sent_callback, (void *)(uintptr_t)parent_generation) < 0)
+      {
+        memcpy(heartbeat_alive, my_heart.alive, SCOPE_BYTES);
+        heartbeat_members++;
+      }
     }
+#if NET_STATS
+    tx_queue_print_stats();
+    rx_dispatch_print_stats();
+    sensor_codec_print_stats();
+#endif
     etimer_reset(&et);
   }
   PROCESS_END();
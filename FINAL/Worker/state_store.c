@@ -0,0 +1,144 @@
+/**
+ * @file    state_store.c
+ * @brief   one persistent state record in a dedicated flash page
+ */
+
+#include "state_store.h"
+#include "lib/crc16.h"
+#include <string.h>
+
+#ifdef NRF52840_XXAA
+#include "nrf.h"
+
+// Last page of the code flash. Without a bootloader nothing else is placed
+// there; flashing with --chiperase clears it.
+#ifndef STATE_STORE_PAGE_ADDR
+#define STATE_STORE_PAGE_ADDR ((NRF_FICR->CODESIZE - 1) * NRF_FICR->CODEPAGESIZE)
+#endif
+#define STATE_STORE_PAGE_SIZE (NRF_FICR->CODEPAGESIZE)
+#define STATE_STORE_MAGIC     0x5354
+#define ERASED_WORD           0xFFFFFFFFu
+
+// Every record starts word aligned with this header. It is written before
+// the data, a record cut short by a reset fails its checksum and is
+// skipped. An erased header marks the free space.
+typedef struct store_hdr
+{
+    uint16_t magic;
+    uint16_t len;
+    uint16_t crc;
+    uint16_t reserved;
+}store_hdr;
+
+static uint32_t record_size(uint16_t len)
+{
+    return sizeof(store_hdr) + ((len + 3u) & ~3u);
+}
+
+static void nvmc_wait(void)
+{
+    while (NRF_NVMC->READY == NVMC_READY_READY_Busy) {
+    }
+}
+
+static void nvmc_mode(uint32_t wen)
+{
+    NRF_NVMC->CONFIG = wen << NVMC_CONFIG_WEN_Pos;
+    nvmc_wait();
+}
+
+// Whole words only, the tail of the last one stays erased.
+static void write_words(uint32_t addr, const void *data, uint32_t len)
+{
+    const uint8_t *src = data;
+    nvmc_mode(NVMC_CONFIG_WEN_Wen);
+    for (uint32_t off = 0; off < len; off += 4) {
+        uint32_t word = ERASED_WORD;
+        memcpy(&word, src + off, len - off < 4 ? len - off : 4);
+        *(volatile uint32_t *)(addr + off) = word;
+        nvmc_wait();
+    }
+    nvmc_mode(NVMC_CONFIG_WEN_Ren);
+}
+
+// Address of the free space behind the records, the newest valid record
+// in *last (0 if there is none).
+static uint32_t scan(uint32_t *last)
+{
+    uint32_t addr = STATE_STORE_PAGE_ADDR;
+    uint32_t end = addr + STATE_STORE_PAGE_SIZE;
+    *last = 0;
+    while (addr + sizeof(store_hdr) <= end) {
+        const store_hdr *h = (const store_hdr *)addr;
+        if (h->magic != STATE_STORE_MAGIC || addr + record_size(h->len) > end) {
+            break;
+        }
+        if (crc16_data((const unsigned char *)(addr + sizeof(store_hdr)), h->len, 0) == h->crc) {
+            *last = addr;
+        }
+        addr += record_size(h->len);
+    }
+    return addr;
+}
+
+int state_store_read(void *data, uint16_t len)
+{
+    uint32_t last;
+    scan(&last);
+    if (last == 0 || ((const store_hdr *)last)->len != len) {
+        return 0;
+    }
+    memcpy(data, (const void *)(last + sizeof(store_hdr)), len);
+    return 1;
+}
+
+// Erasing halts the CPU for about 85 ms, frames arriving meanwhile are
+// lost. It happens once every page full of records.
+int state_store_write(const void *data, uint16_t len)
+{
+    uint32_t last;
+    uint32_t addr = scan(&last);
+    uint32_t end = STATE_STORE_PAGE_ADDR + STATE_STORE_PAGE_SIZE;
+    if (record_size(len) > STATE_STORE_PAGE_SIZE) {
+        return -1;
+    }
+    if (addr + record_size(len) > end || *(const uint32_t *)addr != ERASED_WORD) {
+        state_store_erase();
+        addr = STATE_STORE_PAGE_ADDR;
+    }
+    store_hdr h = { STATE_STORE_MAGIC, len, crc16_data(data, len, 0), 0xFFFF };
+    write_words(addr, &h, sizeof(h));
+    write_words(addr + sizeof(h), data, len);
+    return 0;
+}
+
+// Records are appended from the start, a blank first word is a blank page.
+void state_store_erase(void)
+{
+    if (*(const uint32_t *)STATE_STORE_PAGE_ADDR == ERASED_WORD) {
+        return;
+    }
+    nvmc_mode(NVMC_CONFIG_WEN_Een);
+    NRF_NVMC->ERASEPAGE = STATE_STORE_PAGE_ADDR;
+    nvmc_wait();
+    nvmc_mode(NVMC_CONFIG_WEN_Ren);
+}
+
+#else
+
+// no store on this target, every boot is a cold start
+int state_store_read(void *data, uint16_t len)
+{
+    return 0;
+}
+
+int state_store_write(const void *data, uint16_t len)
+{
+    return -1;
+}
+
+void state_store_erase(void)
+{
+}
+
+#endif
@@ -79,21 +79,32 @@ void MainWindow::changeEvent(QEvent *e) {
     }
 }
 
-//Once this button is pressed, device connected to the PC could be opened and data could be seen
+//Once this button is pressed, device connected to the PC could be opened and data could be seen.
+//Every sink is opened on its own interface; open them one after the other.
 void MainWindow::on_pushButton_open_clicked() {
 
-    port.setQueryMode(QextSerialPort::EventDriven);
+    QString name = "/dev/" + ui->comboBox_Interface->currentText();
+    for (QextSerialPort *other : ports) {
+        if (other->portName() == name) {
+            error.setText("Port already open!");
+            error.show();
+            return;
+        }
+    }
+
+    QextSerialPort *port = new QextSerialPort(QextSerialPort::EventDriven, this);
     //Port name has to be compatible with linux convention
-    port.setPortName("/dev/" + ui->comboBox_Interface->currentText());
-    port.setBaudRate(BAUD115200);
-    port.setFlowControl(FLOW_OFF);
-    port.setParity(PAR_NONE);
-    port.setDataBits(DATA_8);
-    port.setStopBits(STOP_1);
-    port.open(QIODevice::ReadWrite);
-
-    if (!port.isOpen())
+    port->setPortName(name);
+    port->setBaudRate(BAUD115200);
+    port->setFlowControl(FLOW_OFF);
+    port->setParity(PAR_NONE);
+    port->setDataBits(DATA_8);
+    port->setStopBits(STOP_1);
+    port->open(QIODevice::ReadWrite);
+
+    if (!port->isOpen())
     {
+        delete port;
         error.setText("Open port unsuccessful, try again!");
         error.show();
         return;
@@ -111,26 +122,35 @@ void MainWindow::on_pushButton_open_clicked() {
     // }
 
     //Once data is sensed, trigger mainwindow receive function and read serial data
-    QObject::connect(&port, SIGNAL(readyRead()), this, SLOT(receive()));
+    QObject::connect(port, SIGNAL(readyRead()), this, SLOT(receive()));
+    ports.append(port);
 
     ui->pushButton_close->setEnabled(true);         //Enable close button
-    ui->pushButton_open->setEnabled(false);         //Disable open button
-    ui->comboBox_Interface->setEnabled(false);      //Disable dropdown interfaces
 }
 
 void MainWindow::on_pushButton_close_clicked() {
-    if (port.isOpen()) port.close();
+    for (QextSerialPort *port : ports) {
+        if (port->isOpen()) port->close();
+        delete port;
+    }
+    ports.clear();
+    lineBuf.clear();
+    portSink.clear();
     // if (uart->isOpen()) uart->close();
     ui->pushButton_close->setEnabled(false);
-    ui->pushButton_open->setEnabled(true);
-    ui->comboBox_Interface->setEnabled(true);
 }
 
 //Message example: Node: 1 SensorType: 1 Value: 12
+//Sample, occupancy and SinkState lines use the shared numbering and are
+//merged from all sinks. The topology graph shows one tree, the one of the
+//sink at index 0, whose own numbering is the shared one.
 void MainWindow::receive() {
-    static QString str;
+    QextSerialPort *port = qobject_cast<QextSerialPort *>(sender());
+    if (port == nullptr) return;
+    QString &str = lineBuf[port];
+    bool topology = portSink.value(port, 0) == 0;
     char ch;
-    while (port.getChar(&ch)){
+    while (port->getChar(&ch)){
         str.append(ch);
 
         //Detect end of line and decode from here
@@ -141,6 +161,8 @@ void MainWindow::receive() {
             // Prepend current time to the incoming message string
             QString timestamp = QDateTime::currentDateTime().toString("hh:mm:ss");
             QString logLine = timestamp + " | " + str;
+            if (ports.size() > 1)
+                logLine = timestamp + " | " + port->portName() + " | " + str;
 
             // Append the time-stamped message to the QTextEdit for status display
             ui->textEdit_Status->append(logLine);
@@ -151,22 +173,13 @@ void MainWindow::receive() {
                 //Display information in Qt console
                 qDebug() << "Parsed serial input: " << str;
 
-                //Deals with different type of sensors
-                if(!list.isEmpty()){
+                //Deals with different type of sensors, each sample only once
+                if(list.size() >= 8 && acceptSeq(list.at(1).toInt(), list.at(3).toInt(), list)){
                     int i = 0;
                     int sensorType = list.at(i+3).toInt();
                     int nodeID = list.at(i+1).toInt();
                     // When nodeid is fetched, set this node as active
-                    switch (nodeID) {
-                        case 0: ui->work1->setChecked(true); break;
-                        case 1: ui->work2->setChecked(true); break;
-                        case 2: ui->work3->setChecked(true); break;
-                        case 3: ui->work4->setChecked(true); break;
-                        case 4: ui->work5->setChecked(true); break;
-                        case 5: ui->work6->setChecked(true); break;
-                        case 6: ui->work7->setChecked(true); break;
-                        case 7: ui->work8->setChecked(true); break;
-                    }
+                    setNodeActive(nodeID);
 
                     int battery = list.at(i+7).toInt();
                     switch (nodeID) {
@@ -216,14 +229,45 @@ void MainWindow::receive() {
                             qDebug() << "Distance sensor value: " << QString::number(value);
                             break;
                     }
-                    evaluateParkingStatus(nodeID);
                     updateGraphBoxStyle();
                 }
             }
 
+            //Occupancy as decided and debounced on the node
+            //e.g. Node: 3 Occupied: 1 Event: 1 Age: 0 Seq: 17
+            else if (str.contains("Occupied:")) {
+                QStringList list = str.split(QRegExp("\\s"));
+                qDebug() << "Parsed serial input: " << str;
+                if (list.size() >= 4 && acceptSeq(list.at(1).toInt(), 0, list)) {
+                    int nodeID = list.at(1).toInt();
+                    bool occupied = list.at(3).toInt() != 0;
+                    setParkingStatus(nodeID, occupied);
+                }
+            }
+
+            //Summary of one sink: its index, topology version and the
+            //nodes it serves, all in the shared numbering
+            //e.g. SinkState: 0 12 1 2 3
+            else if (str.contains("SinkState:")) {
+                QStringList list = str.split(QRegExp("\\s"), QString::SkipEmptyParts);
+                if (list.size() >= 3) {
+                    int sink = list.at(1).toInt();
+                    portSink[port] = sink;
+                    topology = sink == 0;
+                    setNodeActive(sink);
+                    for (int i = 3; i < list.size(); i++) {
+                        int nodeID = list.at(i).toInt();
+                        if (servingSink.value(nodeID, sink) != sink)
+                            qDebug() << "Node" << nodeID << "moved to sink" << sink;
+                        servingSink[nodeID] = sink;
+                        setNodeActive(nodeID);
+                    }
+                }
+            }
+
             //Change of network topology -- new link is added
             //e.g. NewLink 1 -> 2
-            else if (str.contains("Newlink")){
+            else if (topology && str.contains("Newlink")){
                 int new_src;
                 int new_dest;
                 // Get the current scene from the GraphWidget to modify the visual graph
@@ -264,7 +308,7 @@ void MainWindow::receive() {
             // Change to only receive LinkLost: 1, delete all edges manually
             // Handle node loss notification
             //e.g. LinkLost: 1
-            else if (str.contains("LinkLost:")) {
+            else if (topology && str.contains("LinkLost:")) {
                 int lost_src;
                 // int lost_dest;
                 // Get the current scene from the GraphWidget to modify the visual graph
@@ -314,7 +358,7 @@ void MainWindow::receive() {
             }
 
             //e.g. ClusterHead: 2 3 6
-            else if (str.contains("ClusterHead:")) {
+            else if (topology && str.contains("ClusterHead:")) {
                 int head1;
                 int head2;
                 int head3;
@@ -418,63 +462,80 @@ void MainWindow::createDockWindows()
 }
 
 
+//Commands go to every open sink, each one floods its own network
 void MainWindow::send(QByteArray data) {
     // uart->send(data);
-    port.write(data);
-
-    qint64 bytesWritten = port.write(data);
-    qDebug() << "Sent" << bytesWritten << "bytes:" << data;
+    for (QextSerialPort *port : ports) {
+        qint64 bytesWritten = port->write(data);
+        qDebug() << "Sent" << bytesWritten << "bytes to" << port->portName() << ":" << data;
+    }
 }
 
-// Function to evaluate parking lot status with time-based smoothing
-void MainWindow::evaluateParkingStatus(int nodeID)
+// Several sinks may report the same sample, the lines carry the source's
+// 8 bit sequence number. Each kind of line is applied once per sample and
+// not after a newer one; a big step back is a rebooted node and accepted.
+bool MainWindow::acceptSeq(int nodeID, int kind, const QStringList &list)
 {
-    auto &state = nodeStates[nodeID];  // Access the sensor readings and status tracking
-
-    // Determine the new parking status based on the current sensor values
-    bool newOccupied = (state.light < 100 && state.distance < 50);
-
-    // Only process if both sensors have valid data
-    if (state.light > 0 && state.distance > 0) {
+    int pos = list.indexOf("Seq:");
+    if (pos < 0 || pos + 1 >= list.size() || kind < 0 || kind > 2)
+        return true;
+    int seq = list.at(pos + 1).toInt();
+    int &last = nodeStates[nodeID].lastSeq[kind];
+    int diff = (qint8)(seq - last);
+    if (last >= 0 && diff <= 0 && diff > -16) {
+        qDebug() << "Sample" << seq << "of node" << nodeID << "already applied";
+        return false;
+    }
+    last = seq;
+    return true;
+}
 
-        // If the new reading differs from the last detected state, update the timestamp
-        if (newOccupied != state.currentOccupied) {
-            state.currentOccupied = newOccupied;
-            state.lastStatusChangeTime = QDateTime::currentDateTime();
-        }
+// Mark a node as active once anything was heard about it
+void MainWindow::setNodeActive(int nodeID)
+{
+    switch (nodeID) {
+        case 0: ui->work1->setChecked(true); break;
+        case 1: ui->work2->setChecked(true); break;
+        case 2: ui->work3->setChecked(true); break;
+        case 3: ui->work4->setChecked(true); break;
+        case 4: ui->work5->setChecked(true); break;
+        case 5: ui->work6->setChecked(true); break;
+        case 6: ui->work7->setChecked(true); break;
+        case 7: ui->work8->setChecked(true); break;
+    }
+}
 
-        // If the stable state hasn't been updated yet, check how long the new status has persisted
-        if (state.lastStableOccupied != state.currentOccupied) {
-            qint64 elapsed = state.lastStatusChangeTime.msecsTo(QDateTime::currentDateTime());
-
-            // Confirm the state change only if it has remained stable for more than 5 seconds
-            if (elapsed > 5000) {
-                state.lastStableOccupied = state.currentOccupied;
-
-                // Update the checkbox state: checked = free, unchecked = occupied
-                switch (nodeID) {
-                case 0: ui->park1->setChecked(!state.lastStableOccupied); break;
-                case 1: ui->park2->setChecked(!state.lastStableOccupied); break;
-                case 2: ui->park3->setChecked(!state.lastStableOccupied); break;
-                case 3: ui->park4->setChecked(!state.lastStableOccupied); break;
-                case 4: ui->park5->setChecked(!state.lastStableOccupied); break;
-                case 5: ui->park6->setChecked(!state.lastStableOccupied); break;
-                case 6: ui->park7->setChecked(!state.lastStableOccupied); break;
-                case 7: ui->park8->setChecked(!state.lastStableOccupied); break;
-                }
+// Function to apply the parking status reported by a node
+void MainWindow::setParkingStatus(int nodeID, bool occupied)
+{
+    auto &state = nodeStates[nodeID];
 
-                // Log the new confirmed parking state
-                if (state.lastStableOccupied) {
-                    ui->textEdit_Status->append(QString("Node %1: Car detected - spot occupied").arg(nodeID));
-                } else {
-                    ui->textEdit_Status->append(QString("Node %1: No car - spot available").arg(nodeID));
-                }
+    if (state.lastStableOccupied == occupied) {
+        return;
+    }
+    state.lastStableOccupied = occupied;
+
+    // Update the checkbox state: checked = free, unchecked = occupied
+    switch (nodeID) {
+    case 0: ui->park1->setChecked(!occupied); break;
+    case 1: ui->park2->setChecked(!occupied); break;
+    case 2: ui->park3->setChecked(!occupied); break;
+    case 3: ui->park4->setChecked(!occupied); break;
+    case 4: ui->park5->setChecked(!occupied); break;
+    case 5: ui->park6->setChecked(!occupied); break;
+    case 6: ui->park7->setChecked(!occupied); break;
+    case 7: ui->park8->setChecked(!occupied); break;
+    }
 
-                // Optionally refresh the graph box background
-                updateGraphBoxStyle();
-            }
-        }
+    // Log the new confirmed parking state
+    if (occupied) {
+        ui->textEdit_Status->append(QString("Node %1: Car detected - spot occupied").arg(nodeID));
+    } else {
+        ui->textEdit_Status->append(QString("Node %1: No car - spot available").arg(nodeID));
     }
+
+    // Optionally refresh the graph box background
+    updateGraphBoxStyle();
 }
 
 // Set graphbox to green if parking is available and red if slot is not available or node is not working
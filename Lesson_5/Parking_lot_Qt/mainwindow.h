@@ -43,7 +43,9 @@ protected:
 
 private:
     Ui::MainWindow *ui;
-    QextSerialPort port;
+    QList<QextSerialPort *> ports;          // one per sink
+    QMap<QextSerialPort *, QString> lineBuf;
+    QMap<QextSerialPort *, int> portSink;   // sink index from its SinkState lines
     QMessageBox error;              //Dialog for displaying error messages
     QMessageBox pop_up;
     GraphWidget *widget;
@@ -58,14 +60,16 @@ private:
         double light = -1;
         double distance = -1;
 
-        bool currentOccupied = true;       // current state
-        bool lastStableOccupied = true;    // last stable state
-        QDateTime lastStatusChangeTime;     // last status change time
+        bool lastStableOccupied = true;    // last state reported by the node
+        int lastSeq[3] = {-1, -1, -1};     // per line kind: occupancy, light, distance
     };
 
     QMap<int, SensorState> nodeStates;
+    QMap<int, int> servingSink;            // node -> sink that last listed it
 
-    void evaluateParkingStatus(int nodeID);
+    bool acceptSeq(int nodeID, int kind, const QStringList &list);
+    void setNodeActive(int nodeID);
+    void setParkingStatus(int nodeID, bool occupied);
     void createDockWindows();
     void updateGraphBoxStyle();
     void resetSystem();